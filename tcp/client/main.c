@@ -2,20 +2,38 @@
 #include "lib/termproto.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#ifdef __WIN32__
 #include <windows.h>
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#include <termios.h>
+
+#define INVALID_SOCKET -1
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+#define WSACleanup()
+#endif
 
 static SOCKET g_sfd;
 static struct term_req g_req;
 static char g_running = 0;
 static const size_t g_bufsize = TERMPROTO_BUF_SIZE;
 static char g_buf[TERMPROTO_BUF_SIZE];
+static int g_proto = TERM_PROTO_1;
+static unsigned short g_id;
+static char g_iszip; // asked for deflate with -z
+static z_stream g_zs; // inflates every deflated body of the session
 
 static int prompt_len;
 static char PROMPT[300];
@@ -38,6 +56,7 @@ print_prompt()
 void
 error(const char *err_msg, const SOCKET *socket, void (*exit)(int))
 {
+#ifdef __WIN32__
     static char buf[1024];
     if(0 != WSAGetLastError())
     {
@@ -56,6 +75,12 @@ error(const char *err_msg, const SOCKET *socket, void (*exit)(int))
     {
         fprintf(stderr, "%s\n", err_msg);
     }
+#else
+    if(0 != errno)
+        fprintf(stderr, "%s: %s\n", err_msg, strerror(errno));
+    else
+        fprintf(stderr, "%s\n", err_msg);
+#endif
 
     if(socket != NULL)
     {
@@ -159,10 +184,15 @@ validated_or_get_len(char* cred)
 int
 getuname(const char* prompt, char* uname)
 {
-    char c, rv;
+    char c;
+    int rv;
 
     fputs(prompt, stdout);
     rv = scanf("%10s", uname);
+    if(EOF == rv)
+    {
+        return -1;
+    }
 
     while('\n' != (c = getchar()) && EOF != c);
 
@@ -174,11 +204,13 @@ getuname(const char* prompt, char* uname)
     return validated_or_get_len(uname);
 }
 
+#ifdef __WIN32__
 int
-getpass(const char *prompt, char* password, unsigned char psize)
+getpassword(const char *prompt, char* password, unsigned char psize)
 {  
     DWORD dwRead;
     DWORD con_mode;
+    BOOL isread;
     int overlim = 0;
     unsigned char ch;
     unsigned char plen = 0;
@@ -191,7 +223,7 @@ getpass(const char *prompt, char* password, unsigned char psize)
     GetConsoleMode(hIn, &con_mode);
     SetConsoleMode(hIn, con_mode & ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT));
 
-    while(ReadConsoleA(hIn, &ch, 1, &dwRead, NULL) && '\r' != ch)
+    while((isread = ReadConsoleA(hIn, &ch, 1, &dwRead, NULL)) && '\r' != ch)
     {
         if(plen == plim)
         {
@@ -222,25 +254,72 @@ getpass(const char *prompt, char* password, unsigned char psize)
     password[plen] = '\0';
     SetConsoleMode(hIn, con_mode);
     putchar('\n');
+    if(!isread)
+    {
+        return -1;
+    }
+
+    return validated_or_get_len(password);
+}
+#else
+int
+getpassword(const char *prompt, char* password, unsigned char psize)
+{
+    size_t len;
+    char* rv;
+    char line[TERMPROTO_PATH_SIZE];
+    struct termios mode;
+    struct termios noecho;
+    int istty = (0 == tcgetattr(STDIN_FILENO, &mode));
+
+    fputs(prompt, stdout);
+    if(istty)
+    {
+        noecho = mode;
+        noecho.c_lflag &= ~ECHO;
+        tcsetattr(STDIN_FILENO, TCSANOW, &noecho);
+    }
+    rv = fgets(line, sizeof(line), stdin);
+    if(istty)
+        tcsetattr(STDIN_FILENO, TCSANOW, &mode);
+    putchar('\n');
+    if(NULL == rv)
+    {
+        return -1;
+    }
+
+    len = strcspn(line, "\r\n");
+    if(len > (size_t) psize - 1)
+        len = psize - 1;
+    memcpy(password, line, len);
+    password[len] = '\0';
 
     return validated_or_get_len(password);
 }
+#endif
 
 void
 mk_auth_req()
 {
+    int rv;
     unsigned char credsize = 11;
     char uname[credsize];
     char pass[credsize];
 
-    while(0 == getuname("Username: ", uname))
+    // -1 is the end of stdin, nobody is left to try again
+    while(0 == (rv = getuname("Username: ", uname)))
     {
         fprintf(stderr, "Bad username. Try again\n");
     }
-    while(0 == getpass("Password: ", pass, credsize))
+    while(-1 != rv && 0 == (rv = getpassword("Password: ", pass, credsize)))
     {
         fprintf(stderr, "Bad password. Try again\n");
     }
+    if(-1 == rv)
+    {
+        fprintf(stderr, "No credentials on stdin\n");
+        exit(EXIT_FAILURE);
+    }
 
     g_req.method = AUTH;
     snprintf(g_req.path, TERMPROTO_PATH_SIZE, "%s;%s",
@@ -264,7 +343,15 @@ send_req()
 {
     size_t n;
 
-    n = term_mk_req_header(&g_req, g_buf, g_bufsize);
+    if(TERM_PROTO_BIN == g_proto)
+    {
+        g_req.id = ++g_id;
+        n = term_mk_bin_req(&g_req, g_buf, g_bufsize);
+    }
+    else
+    {
+        n = term_mk_req_header(&g_req, g_buf, g_bufsize);
+    }
     if(-1 == sendall(g_sfd, g_buf, &n))
         error("sendall() failed", NULL, exit);
 }
@@ -302,11 +389,94 @@ seek_to_resp_body()
     }
 }
 
+/**
+ * Reads the fixed size part of a binary frame into g_buf.
+ */
 void
-print_resp_body(msgsize_t size)
+read_frame_part(size_t size)
+{
+    int rv = readn(g_sfd, g_buf, size);
+
+    if(0 == rv)
+        error("Server shut down", NULL, exit);
+    else if((int) size != rv)
+        error("readn() failed", NULL, exit);
+}
+
+/**
+ * Reads a response header in the framing agreed on and skips to the
+ * body. Returns 0 or -1 if it is not a header of the response expected.
+ */
+int
+read_resp_header(msgsize_t* size)
+{
+    int rv;
+    unsigned short id = g_req.id;
+
+    if(TERM_PROTO_BIN == g_proto)
+    {
+        read_frame_part(TERM_BIN_RESP_SIZE);
+        rv = term_parse_bin_resp(&g_req, g_buf, size);
+        return (0 == rv && id == g_req.id) ? 0 : -1;
+    }
+
+    if(0 == read_resp_line())
+        error("A response header was expected", NULL, exit);
+    rv = term_parse_resp_status(&g_req, g_buf, g_proto, size);
+    if(0 == rv && 0 < *size)
+        seek_to_resp_body();
+    return rv;
+}
+
+msgsize_t
+read_chunk_size()
+{
+    msgsize_t size;
+
+    if(TERM_PROTO_BIN == g_proto)
+    {
+        read_frame_part(TERM_BIN_CHUNK_SIZE);
+        return term_parse_bin_chunk(g_buf);
+    }
+    read_resp_line();
+    if(-1 == term_parse_chunk(g_buf, &size))
+        error("Received a bad chunk", NULL, exit);
+    return size;
+}
+
+/**
+ * Prints a piece of the body, inflating it if it is deflated.
+ */
+void
+print_piece(char* data, size_t len)
+{
+    int rv;
+    char out[4096];
+
+    if(!(g_req.flags & TERM_F_DEFLATE))
+    {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+
+    g_zs.next_in = (Bytef*) data;
+    g_zs.avail_in = len;
+    do
+    {
+        g_zs.next_out = (Bytef*) out;
+        g_zs.avail_out = sizeof(out);
+        rv = inflate(&g_zs, Z_SYNC_FLUSH);
+        if(Z_OK != rv && Z_BUF_ERROR != rv)
+            error("Received a bad deflate stream", NULL, exit);
+        fwrite(out, 1, sizeof(out) - g_zs.avail_out, stdout);
+    } while(0 == g_zs.avail_out);
+}
+
+void
+print_body_part(msgsize_t size)
 {
     int rv;
-    size_t left, toread;
+    msgsize_t left, toread;
 
     left = size;
     while(left > 0)
@@ -316,8 +486,7 @@ print_resp_body(msgsize_t size)
         if(rv > 0)
         {
             left -= rv;
-            g_buf[rv] = '\0';
-            fputs(g_buf, stdout);
+            print_piece(g_buf, rv);
         }
         else if(rv == 0)
         {
@@ -328,13 +497,48 @@ print_resp_body(msgsize_t size)
             error("readn() failed", NULL, exit);
         }
     }
+}
+
+void
+print_resp_body(msgsize_t size)
+{
+    print_body_part(size);
     putchar('\n');
 }
 
+/**
+ * A chunked body is a series of chunks up to an empty one.
+ */
+void
+print_resp_chunks()
+{
+    msgsize_t size;
+
+    do
+    {
+        size = read_chunk_size();
+        print_body_part(size);
+    } while(0 < size);
+    putchar('\n');
+}
+
+void
+print_resp(msgsize_t size)
+{
+    if(TERM_CHUNKED == size)
+        print_resp_chunks();
+    else
+        print_resp_body(size);
+}
+
 void
 cp_resp_body(msgsize_t size)
 {
-    int rv = readn(g_sfd, g_buf, size);
+    int rv;
+
+    if(size >= g_bufsize)
+        error("The response is too long", NULL, exit);
+    rv = readn(g_sfd, g_buf, size);
     if(0 < rv)
     {
         char* p = g_buf + rv;
@@ -361,18 +565,10 @@ cp_resp_body(msgsize_t size)
 void
 recv_resp()
 {
-    int resp_body_size;
+    msgsize_t resp_body_size;
 
-    if(0 == read_resp_line())
-        error("A response header was expected", NULL, exit);
-
-    if(0 <= (resp_body_size = term_parse_resp_status(&g_req, g_buf)))
+    if(0 == read_resp_header(&resp_body_size))
     {
-        if(0 < resp_body_size)
-        {
-            seek_to_resp_body();
-        }
-
         if(OK == g_req.status)
         {
             switch(g_req.method)
@@ -381,10 +577,18 @@ recv_resp()
                     cp_resp_body(resp_body_size);
                     set_prompt(g_buf);
                     break;
+                case PROTO:
+                    cp_resp_body(resp_body_size);
+                    g_proto = atoi(g_buf);
+                    if(NULL == strstr(g_buf, "deflate"))
+                        g_iszip = 0;
+                    else if(Z_OK != inflateInit(&g_zs))
+                        error("inflateInit() failed", NULL, exit);
+                    break;
                 case AUTH:
                 case LS:
                 case WHO:
-                    print_resp_body(resp_body_size);
+                    print_resp(resp_body_size);
                     break;
                 case LOGOUT:
                     g_running = 0;
@@ -398,7 +602,7 @@ recv_resp()
             print_bad_resp();
             if(AUTH == g_req.method && FORBIDDEN == g_req.status)
             {
-                print_resp_body(resp_body_size);
+                print_resp(resp_body_size);
             }
         }
     }
@@ -437,6 +641,9 @@ parse_cmd(const char* buf)
                 case AUTH:
                     printf("You are already logged in\n");
                     return -1;
+                case PROTO:
+                    printf("The revision is %d already\n", g_proto);
+                    return -1;
                 case CD:
                 case LS:
                 case WHO:
@@ -480,7 +687,8 @@ read_cmd(char* buf, int bufsize)
     *buf = '\0';
     if(NULL == fgets(buf, bufsize, stdin))
     {
-        perror("fgets() failed while reading stdin");
+        if(ferror(stdin))
+            perror("fgets() failed while reading stdin");
         return -1;
     }
     if(isempty(buf))
@@ -496,6 +704,20 @@ read_cmd(char* buf, int bufsize)
     return buflen;
 }
 
+/**
+ * Asks for the newest revision we know. An old server does not know
+ * PROTO, answers 400 and we stay at revision 1. A server that does not
+ * know deflate leaves it out of the answer.
+ */
+void
+negotiate()
+{
+    g_req.method = PROTO;
+    snprintf(g_req.path, TERMPROTO_PATH_SIZE, "%d%s", TERM_PROTO_MAX,
+            g_iszip ? " deflate" : "");
+    handle_cmd();
+}
+
 void
 authenticate()
 {
@@ -512,19 +734,22 @@ authenticate()
 void
 runclient()
 {
-    size_t cmdlen;
+    int cmdlen;
     enum {CMDBUFSIZE = 300};
     char cmdbuf[CMDBUFSIZE];
 
     g_running = 1;
     setvbuf(stdout, NULL, _IONBF, 0);
 
+    negotiate();
     authenticate();
 
     while(g_running)
     {
         print_prompt();
         cmdlen = read_cmd(cmdbuf, CMDBUFSIZE);
+        if(-1 == cmdlen)
+            break;
         if(0 == cmdlen)
             continue;
         if(-1 == parse_cmd(cmdbuf))
@@ -542,19 +767,30 @@ runclient()
 int
 main(int argc, char** argv)
 {
-    if(3 != argc)
+    int opt;
+
+    while(-1 != (opt = getopt(argc, argv, "z")))
+    {
+        if('z' == opt)
+            g_iszip = 1;
+        else
+            argc = 0;
+    }
+    if(optind + 2 != argc)
     {
-        fprintf(stderr, "Usage: %s hostname port\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-z] hostname port\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
+#ifdef __WIN32__
     WSADATA wsaData;
     if(0 != WSAStartup(MAKEWORD(2, 2), &wsaData))
     {
         error("WSAStartup() failed", NULL, exit);
     }
+#endif
 
-    prepareclient(argv[1], argv[2]);
+    prepareclient(argv[optind], argv[optind + 1]);
     runclient();
 
     WSACleanup();
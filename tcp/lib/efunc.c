@@ -74,6 +74,25 @@ readn(SOCKET sfd, char *buf, size_t len)
     return len;
 }
 
+/**
+ * Does one recv() of up to <len> bytes into the tail of the buffer.
+ */
+int
+recvbuf(SOCKET sfd, struct iobuf* b, size_t len)
+{
+    int rc;
+
+    if(-1 == iobuf_reserve(b, len))
+        return -1;
+    do
+    {
+        rc = recv(sfd, b->b_data + b->b_len, b->b_cap - b->b_len, 0);
+    } while(0 > rc && EINTR == errno);
+    if(0 < rc)
+        b->b_len += rc;
+    return rc;
+}
+
 int
 sendall(SOCKET sfd, const char* buf, size_t* bsize)
 {
@@ -6,6 +6,8 @@
 #else
 typedef int SOCKET;
 #endif
+#include "iobuf.h"
+
 #include <stddef.h>
 
 int
@@ -14,6 +16,9 @@ readcrlf(SOCKET sfd, char *buf, size_t bsize);
 int
 readn(SOCKET sfd, char *buf, size_t len);
 
+int
+recvbuf(SOCKET sfd, struct iobuf* b, size_t len);
+
 int
 sendall(SOCKET sfd, const char* buf, size_t* bsize);
 
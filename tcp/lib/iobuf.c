@@ -0,0 +1,139 @@
+#include "iobuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int
+iobuf_init(struct iobuf* b, size_t cap)
+{
+    b->b_off = 0;
+    b->b_len = 0;
+    b->b_scan = 0;
+    b->b_cap = cap;
+    b->b_data = malloc(cap);
+    return (NULL == b->b_data) ? -1 : 0;
+}
+
+void
+iobuf_free(struct iobuf* b)
+{
+    free(b->b_data);
+    memset(b, 0, sizeof(struct iobuf));
+}
+
+int
+iobuf_reserve(struct iobuf* b, size_t n)
+{
+    size_t size = b->b_len - b->b_off;
+
+    if(b->b_cap - b->b_len >= n)
+        return 0;
+
+    if(0 < b->b_off)
+    {
+        memmove(b->b_data, b->b_data + b->b_off, size);
+        b->b_scan -= b->b_off;
+        b->b_off = 0;
+        b->b_len = size;
+        if(b->b_cap - b->b_len >= n)
+            return 0;
+    }
+
+    size_t cap = (0 != b->b_cap) ? b->b_cap : 64;
+    while(cap - size < n)
+        cap <<= 1;
+
+    char* data = realloc(b->b_data, cap);
+    if(NULL == data)
+        return -1;
+    b->b_data = data;
+    b->b_cap = cap;
+    return 0;
+}
+
+/**
+ * Gives the memory of an empty buffer back down to cap bytes.
+ */
+void
+iobuf_shrink(struct iobuf* b, size_t cap)
+{
+    char* data;
+
+    if(0 != iobuf_size(b) || b->b_cap <= cap)
+        return;
+    data = realloc(b->b_data, cap);
+    if(NULL == data)
+        return;
+    b->b_data = data;
+    b->b_cap = cap;
+    b->b_off = 0;
+    b->b_len = 0;
+    b->b_scan = 0;
+}
+
+int
+iobuf_append(struct iobuf* b, const char* data, size_t n)
+{
+    if(-1 == iobuf_reserve(b, n))
+        return -1;
+    memcpy(b->b_data + b->b_len, data, n);
+    b->b_len += n;
+    return 0;
+}
+
+void
+iobuf_consume(struct iobuf* b, size_t n)
+{
+    b->b_off += n;
+    if(b->b_off >= b->b_len)
+    {
+        b->b_off = 0;
+        b->b_len = 0;
+        b->b_scan = 0;
+    }
+    else if(b->b_scan < b->b_off)
+    {
+        b->b_scan = b->b_off;
+    }
+}
+
+size_t
+iobuf_size(const struct iobuf* b)
+{
+    return b->b_len - b->b_off;
+}
+
+/**
+ * Takes the next complete line out of the buffer. The line terminator
+ * (LF or CRLF) is replaced by '\0' in place, so the line is not copied;
+ * it stays valid until the buffer is written to again.
+ * Every byte is scanned only once however many reads a line takes.
+ * Returns 0 if there is no complete line yet.
+ */
+int
+iobuf_getline(struct iobuf* b, char** line, size_t* len)
+{
+    char* start = b->b_data + b->b_off;
+    char* lf = memchr(b->b_data + b->b_scan, '\n', b->b_len - b->b_scan);
+
+    if(NULL == lf)
+    {
+        b->b_scan = b->b_len;
+        return 0;
+    }
+
+    *len = lf - start;
+    if(0 < *len && '\r' == start[*len - 1])
+        --*len;
+    start[*len] = '\0';
+    *line = start;
+
+    iobuf_consume(b, lf - start + 1);
+    return 1;
+}
+
+int
+iobuf_hasline(const struct iobuf* b)
+{
+    return NULL != memchr(b->b_data + b->b_scan, '\n', b->b_len - b->b_scan);
+}
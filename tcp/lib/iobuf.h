@@ -0,0 +1,47 @@
+#ifndef IOBUF_H
+#define IOBUF_H
+
+#include <stddef.h>
+
+/**
+ * A growable byte buffer. Data lives in [b_off, b_len), free space
+ * at the tail is reclaimed by moving the data to the front.
+ * Bytes before b_scan are known to contain no line feed.
+ */
+struct iobuf
+{
+    char* b_data;
+    size_t b_off;
+    size_t b_len;
+    size_t b_cap;
+    size_t b_scan;
+};
+
+int
+iobuf_init(struct iobuf* b, size_t cap);
+
+void
+iobuf_free(struct iobuf* b);
+
+int
+iobuf_reserve(struct iobuf* b, size_t n);
+
+void
+iobuf_shrink(struct iobuf* b, size_t cap);
+
+int
+iobuf_append(struct iobuf* b, const char* data, size_t n);
+
+void
+iobuf_consume(struct iobuf* b, size_t n);
+
+size_t
+iobuf_size(const struct iobuf* b);
+
+int
+iobuf_getline(struct iobuf* b, char** line, size_t* len);
+
+int
+iobuf_hasline(const struct iobuf* b);
+
+#endif
@@ -1,18 +1,12 @@
 #include "termproto.h"
 
-#ifdef __linux__
-#include "logger/logger.h"
-#else
-    void logger_log(char* phony, ...) { };
-#endif
-
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 static const char * const TERM_METHOD_STRING[] = {
-    "AUTH", "LS", "CD", "KILL", "WHO", "LOGOUT"
+    "AUTH", "LS", "CD", "KILL", "WHO", "LOGOUT", "PROTO"
 };
 
 static const char * const TERM_STATUS_ALL[] = {
@@ -21,9 +15,65 @@ static const char * const TERM_STATUS_ALL[] = {
     "403", "Forbidden",
     "404", "Not Found",
     "405", "Not a Directory",
-    "500", "Internal Server Error"
+    "500", "Internal Server Error",
+    "503", "Service Unavailable"
+};
+
+/* " <code> <text>\r\n" for every status, indexed by status / 2 */
+#define TERM_LINE(code, text) \
+    { " " code " " text "\r\n", sizeof(" " code " " text "\r\n") - 1 }
+
+static const struct
+{
+    const char* sl_str;
+    size_t sl_len;
+} TERM_STATUS_LINE[] = {
+    TERM_LINE("200", "OK"),
+    TERM_LINE("400", "Bad Request"),
+    TERM_LINE("403", "Forbidden"),
+    TERM_LINE("404", "Not Found"),
+    TERM_LINE("405", "Not a Directory"),
+    TERM_LINE("500", "Internal Server Error"),
+    TERM_LINE("503", "Service Unavailable")
 };
 
+static const char DIGITS2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/**
+ * Writes v in decimal, two digits per step, and returns the length.
+ * buf has to hold 20 bytes; no terminator is written.
+ */
+static size_t
+term_utoa(char* buf, unsigned long long v)
+{
+    char tmp[20];
+    char* p = tmp + sizeof(tmp);
+    size_t n;
+
+    while(100 <= v)
+    {
+        p -= 2;
+        memcpy(p, DIGITS2 + 2 * (v % 100), 2);
+        v /= 100;
+    }
+    if(10 <= v)
+    {
+        p -= 2;
+        memcpy(p, DIGITS2 + 2 * v, 2);
+    }
+    else
+    {
+        *--p = '0' + v;
+    }
+
+    n = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, n);
+    return n;
+}
+
 char*
 term_get_method(int method)
 {
@@ -54,72 +104,189 @@ find_str_idx(const char* str, const char * const set[], size_t latest_el)
     }
 }
 
+/**
+ * The methods are told apart by the length and the first letter, which
+ * is a perfect hash for this set; one memcmp() confirms the match.
+ */
+int
+term_find_method(const char* method, size_t len)
+{
+    int m;
+
+    switch(len)
+    {
+        case 2:
+            m = ('L' == method[0]) ? LS : ('C' == method[0]) ? CD : -1;
+            break;
+        case 3:
+            m = WHO;
+            break;
+        case 4:
+            m = ('A' == method[0]) ? AUTH : ('K' == method[0]) ? KILL : -1;
+            break;
+        case 5:
+            m = PROTO;
+            break;
+        case 6:
+            m = LOGOUT;
+            break;
+        default:
+            m = -1;
+    }
+
+    if(-1 != m && 0 != memcmp(method, TERM_METHOD_STRING[m], len))
+        return -1;
+    return m;
+}
+
 int
 term_is_valid_method(const char* method)
 {
-    return find_str_idx(method, TERM_METHOD_STRING, LOGOUT);
+    return term_find_method(method, strlen(method));
 }
 
 int
 term_is_valid_status(const char* status)
 {
-    return find_str_idx(status, TERM_STATUS_ALL, INTERNAL_ERROR);
+    return find_str_idx(status, TERM_STATUS_ALL, SERVICE_UNAVAILABLE);
+}
+
+const char*
+term_parse_strerror(int error)
+{
+    switch(error)
+    {
+        case TERM_ENOMETHOD:
+            return "no method";
+        case TERM_EMETHOD:
+            return "unknown method";
+        case TERM_ENOARG:
+            return "no argument";
+        case TERM_ETOOLONG:
+            return "the argument is too long";
+        case TERM_EBADARG:
+            return "the argument holds a null byte";
+        default:
+            return "unknown error";
+    }
+}
+
+static int
+isblank_c(char c)
+{
+    return ' ' == c || '\t' == c;
 }
 
+/**
+ * Parses "METHOD argument" in one pass over a null-terminated line
+ * with the line terminator already stripped. The argument is not
+ * copied, req->arg points into buf. Returns 0 or one of
+ * TERM_PARSE_ERROR.
+ */
 int
 term_parse_req(struct term_req* req, const char* buf)
 {
-    char method[8];
+    const char* s = buf;
+    const char* arg;
+    int m;
 
-    int rv;
-    errno = 0;
-    rv = sscanf(buf, "%7[A-Z] %255[^\r\n]",
-                    method, req->path);
-    if(2 == rv)
-    {
-        rv = term_is_valid_method(method);
-        if(-1 == rv)
-        {
-            req->status = BAD_REQUEST;
-            return -1;
-        }
-        req->method = rv;
-        return 0;
-    }
-    else if(0 < rv)
+    req->status = BAD_REQUEST;
+    req->arg = NULL;
+    req->arglen = 0;
+
+    while('A' <= *s && *s <= 'Z')
+        ++s;
+    if(s == buf)
+        return TERM_ENOMETHOD;
+
+    m = term_find_method(buf, s - buf);
+    if(-1 == m)
+        return TERM_EMETHOD;
+
+    while(isblank_c(*s))
+        ++s;
+    arg = s;
+    while('\0' != *s)
+        ++s;
+    if(s == arg)
+        return TERM_ENOARG;
+    if(s - arg >= TERMPROTO_PATH_SIZE)
+        return TERM_ETOOLONG;
+
+    req->method = m;
+    req->arg = arg;
+    req->arglen = s - arg;
+    req->status = OK;
+    return 0;
+}
+
+/**
+ * The header is the length, a precomputed status line and, if there is
+ * a body, an empty line. Returns 0 if it does not fit into buf.
+ * Revision 1 writes the length as a signed short, as its clients read
+ * it so; TERM_CHUNKED and flags need revision 2.
+ */
+size_t
+term_put_header(char* buf, size_t bufsize, int rev, enum TERM_STATUS status,
+        msgsize_t size, int flags)
+{
+    char num[24];
+    size_t n = 0;
+    short ssize = (short) size;
+    size_t extra = (0 < size) ? 2 : 0;
+
+    if(TERM_PROTO_2 <= rev)
     {
-        logger_log("[termproto] Not all values were matched\n");
-        req->status = BAD_REQUEST;
+        if(TERM_CHUNKED == size)
+            num[n++] = '*';
+        else
+            n += term_utoa(num, size);
+        if(flags & TERM_F_DEFLATE)
+            num[n++] = 'z';
     }
-    else if(0 == errno)
+    else if(0 > ssize)
     {
-        logger_log("[termproto] No matching values\n");
-        req->status = BAD_REQUEST;
+        num[n++] = '-';
+        n += term_utoa(num + n, -(int) ssize);
     }
     else
     {
-        logger_log("[termproto] sscanf failed: %s\n", strerror(errno));
-        req->status = INTERNAL_ERROR;
+        n += term_utoa(num + n, ssize);
     }
-    return -1;
-}
 
-msgsize_t
-term_put_header(char* buf, msgsize_t bufsize, enum TERM_STATUS status,
-        msgsize_t size)
-{
-    msgsize_t n = snprintf(buf, bufsize, "%hd %s %s\r\n",
-            size, TERM_STATUS_ALL[status], TERM_STATUS_ALL[status + 1]);
-    if(0 < size && (msgsize_t) n + 2 < bufsize)
+    if(n + TERM_STATUS_LINE[status / 2].sl_len + extra >= bufsize)
+        return 0;
+    memcpy(buf, num, n);
+    memcpy(buf + n, TERM_STATUS_LINE[status / 2].sl_str,
+            TERM_STATUS_LINE[status / 2].sl_len);
+    n += TERM_STATUS_LINE[status / 2].sl_len;
+    if(extra)
     {
-        strcat(buf, "\r\n");
+        memcpy(buf + n, "\r\n", 2);
         n += 2;
     }
+    buf[n] = '\0';
     return n;
 }
 
+/**
+ * Writes the "<len>\r\n" line in front of a chunk, 0 closes the body.
+ */
+size_t
+term_put_chunk(char* buf, size_t bufsize, msgsize_t size)
+{
+    char num[20];
+    size_t n = term_utoa(num, size);
+
+    if(n + 2 >= bufsize)
+        return 0;
+    memcpy(buf, num, n);
+    memcpy(buf + n, "\r\n", 3);
+    return n + 2;
+}
+
 size_t
-term_mk_req_header(struct term_req* req, char* buf, msgsize_t bufsize)
+term_mk_req_header(struct term_req* req, char* buf, size_t bufsize)
 {
     size_t n;
     n = snprintf(buf, bufsize, "%s %s\r\n",
@@ -127,24 +294,200 @@ term_mk_req_header(struct term_req* req, char* buf, msgsize_t bufsize)
     return (n < bufsize) ? n : bufsize;
 }
 
+static int
+parse_size(const char* buf, int rev, msgsize_t* size)
+{
+    char* end;
+
+    errno = 0;
+    if(TERM_PROTO_2 <= rev)
+    {
+        if('*' == buf[0])
+        {
+            *size = TERM_CHUNKED;
+            return 1;
+        }
+        if(buf[0] < '0' || '9' < buf[0])
+            return 0;
+        *size = strtoull(buf, &end, 10);
+    }
+    else
+    {
+        *size = (unsigned short) strtol(buf, &end, 10);
+    }
+    return (0 == errno && end != buf) ? end - buf : 0;
+}
+
 int
-term_parse_resp_status(struct term_req* req, char* buf)
+term_parse_resp_status(struct term_req* req, char* buf, int rev,
+        msgsize_t* size)
 {
     int rv;
-    msgsize_t size;
+    int n;
     char status[4];
     char status_txt[22];
     status_txt[0] = '\0';
-    
-    rv = sscanf(buf, "%hd %3s %21[^\r\n]", &size, status, status_txt);
-    if(3 <= rv)
+
+    n = parse_size(buf, rev, size);
+    if(0 == n)
+        return -1;
+    req->flags = 0;
+    if(TERM_PROTO_2 <= rev && 'z' == buf[n])
+    {
+        req->flags |= TERM_F_DEFLATE;
+        ++n;
+    }
+    rv = sscanf(buf + n, " %3s %21[^\r\n]", status, status_txt);
+    if(2 <= rv)
     {
         int s = term_is_valid_status(status);
         if(-1 == s)
             return s;
         req->status = s;
         strncpy(req->path, status_txt, 22);
-        return size;
+        return 0;
     }
     return -1;
 }
+
+int
+term_parse_chunk(const char* buf, msgsize_t* size)
+{
+    return (0 < parse_size(buf, TERM_PROTO_2, size)
+            && TERM_CHUNKED != *size) ? 0 : -1;
+}
+
+static void
+put_be(char* buf, unsigned long long v, int n)
+{
+    while(0 < n--)
+    {
+        buf[n] = (char) (v & 0xff);
+        v >>= 8;
+    }
+}
+
+static unsigned long long
+get_be(const char* buf, int n)
+{
+    int i;
+    unsigned long long v = 0;
+
+    for(i = 0; i < n; ++i)
+        v = (v << 8) | (unsigned char) buf[i];
+    return v;
+}
+
+/**
+ * Returns the length of the binary request starting at buf, 0 if its
+ * header is not complete yet, (size_t) -1 if buf holds no request.
+ */
+size_t
+term_bin_reqlen(const char* buf, size_t len)
+{
+    if(0 < len && TERM_BIN_MAGIC != (unsigned char) buf[0])
+        return (size_t) -1;
+    if(TERM_BIN_REQ_SIZE > len)
+        return 0;
+    return TERM_BIN_REQ_SIZE + (size_t) get_be(buf + 4, 4);
+}
+
+/**
+ * Parses a complete binary request. The argument is copied into
+ * req->path and terminated there. Returns 0 or one of TERM_PARSE_ERROR.
+ */
+int
+term_parse_bin_req(struct term_req* req, const char* buf)
+{
+    size_t arglen = get_be(buf + 4, 4);
+
+    req->status = BAD_REQUEST;
+    req->id = get_be(buf + 2, 2);
+    req->arg = NULL;
+    req->arglen = 0;
+
+    if(PROTO < (unsigned char) buf[1])
+        return TERM_EMETHOD;
+    if(0 == arglen)
+        return TERM_ENOARG;
+    if(TERMPROTO_PATH_SIZE <= arglen)
+        return TERM_ETOOLONG;
+    if(NULL != memchr(buf + TERM_BIN_REQ_SIZE, '\0', arglen))
+        return TERM_EBADARG;
+
+    memcpy(req->path, buf + TERM_BIN_REQ_SIZE, arglen);
+    req->path[arglen] = '\0';
+    req->method = (unsigned char) buf[1];
+    req->arg = req->path;
+    req->arglen = arglen;
+    req->status = OK;
+    return 0;
+}
+
+/**
+ * Writes the request with req->path as the argument.
+ * Returns 0 if it does not fit into buf.
+ */
+size_t
+term_mk_bin_req(const struct term_req* req, char* buf, size_t bufsize)
+{
+    size_t arglen = strlen(req->path);
+
+    if(TERM_BIN_REQ_SIZE + arglen > bufsize)
+        return 0;
+    buf[0] = (char) TERM_BIN_MAGIC;
+    buf[1] = (char) req->method;
+    put_be(buf + 2, req->id, 2);
+    put_be(buf + 4, arglen, 4);
+    memcpy(buf + TERM_BIN_REQ_SIZE, req->path, arglen);
+    return TERM_BIN_REQ_SIZE + arglen;
+}
+
+size_t
+term_put_bin_header(char* buf, size_t bufsize, unsigned short id,
+        enum TERM_STATUS status, msgsize_t size, int flags)
+{
+    if(TERM_BIN_RESP_SIZE > bufsize)
+        return 0;
+    buf[0] = (char) TERM_BIN_MAGIC;
+    buf[1] = (char) (status / 2);
+    if(flags & TERM_F_DEFLATE)
+        buf[1] |= TERM_BIN_DEFLATE;
+    put_be(buf + 2, id, 2);
+    put_be(buf + 4, size, 8);
+    return TERM_BIN_RESP_SIZE;
+}
+
+size_t
+term_put_bin_chunk(char* buf, size_t bufsize, msgsize_t size)
+{
+    if(TERM_BIN_CHUNK_SIZE > bufsize)
+        return 0;
+    put_be(buf, size, TERM_BIN_CHUNK_SIZE);
+    return TERM_BIN_CHUNK_SIZE;
+}
+
+/**
+ * Parses the TERM_BIN_RESP_SIZE bytes of a response header.
+ * Returns 0 or -1 if they are not one.
+ */
+int
+term_parse_bin_resp(struct term_req* req, const char* buf, msgsize_t* size)
+{
+    int status = 2 * ((unsigned char) buf[1] & ~TERM_BIN_DEFLATE);
+
+    if(TERM_BIN_MAGIC != (unsigned char) buf[0]
+            || SERVICE_UNAVAILABLE < status)
+        return -1;
+    req->status = status;
+    req->flags = (buf[1] & TERM_BIN_DEFLATE) ? TERM_F_DEFLATE : 0;
+    req->id = get_be(buf + 2, 2);
+    *size = get_be(buf + 4, 8);
+    return 0;
+}
+
+msgsize_t
+term_parse_bin_chunk(const char* buf)
+{
+    return get_be(buf, TERM_BIN_CHUNK_SIZE);
+}
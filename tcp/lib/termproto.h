@@ -6,10 +6,50 @@
 #define TERMPROTO_PATH_SIZE 256
 #define TERMPROTO_BUF_SIZE 1024
 
-typedef unsigned short int msgsize_t;
+typedef unsigned long long msgsize_t;
+
+#define TERM_CHUNKED ((msgsize_t) -1) // the body comes in chunks
+
+/*
+ * Revision 1 sends body lengths as a signed short. Revision 2, agreed on
+ * with "PROTO 2", sends them in full or as "*" for a chunked body:
+ * "<len>\r\n<data>" chunks closed by "0\r\n". Revision 3 switches to
+ * binary frames after the reply to PROTO.
+ */
+enum TERM_PROTO {
+    TERM_PROTO_1 = 1,
+    TERM_PROTO_2 = 2,
+    TERM_PROTO_BIN = 3,
+    TERM_PROTO_MAX = TERM_PROTO_BIN
+};
+
+#define TERM_PROTO_1_MAX 0xffff // longer bodies cannot be sent in rev 1
+
+/*
+ * After "PROTO <rev> deflate", rev 2 at least, long bodies may come as
+ * parts of one deflate stream kept for the whole session, each part
+ * ending with a sync flush. Their size is followed by 'z'.
+ */
+#define TERM_F_DEFLATE 0x1
+
+/*
+ * Binary frames, all numbers big-endian. A request is the header
+ *     magic:8 method:8 id:16 arglen:32
+ * and arglen raw bytes of the argument. A response is the header
+ *     magic:8 status:8 id:16 size:64
+ * and the body, with the id of the request and status / 2 of
+ * TERM_STATUS, TERM_BIN_DEFLATE set for a deflated body. A chunked
+ * body has the size TERM_CHUNKED and comes as size:32 prefixed chunks
+ * closed by an empty one.
+ */
+#define TERM_BIN_MAGIC 0xb1
+#define TERM_BIN_REQ_SIZE 8
+#define TERM_BIN_RESP_SIZE 12
+#define TERM_BIN_CHUNK_SIZE 4
+#define TERM_BIN_DEFLATE 0x80
 
 enum TERM_METHOD {
-    AUTH, LS, CD, KILL, WHO, LOGOUT
+    AUTH, LS, CD, KILL, WHO, LOGOUT, PROTO
 };
 
 enum TERM_STATUS {
@@ -19,13 +59,31 @@ enum TERM_STATUS {
     FORBIDDEN = 4,
     NOT_FOUND = 6,
     NOT_DIR = 8,
-    INTERNAL_ERROR = 10
+    INTERNAL_ERROR = 10,
+    SERVICE_UNAVAILABLE = 12
+};
+
+enum TERM_PARSE_ERROR {
+    TERM_ENOMETHOD = -1, // the line does not start with a method
+    TERM_EMETHOD = -2, // unknown method
+    TERM_ENOARG = -3, // no argument after the method
+    TERM_ETOOLONG = -4, // the argument does not fit TERMPROTO_PATH_SIZE
+    TERM_EBADARG = -5 // a binary argument holds a null byte
 };
 
 struct term_req {
+    unsigned short id; // of a binary request, echoed in the response
     enum TERM_METHOD method;
     char path[TERMPROTO_PATH_SIZE];
     enum TERM_STATUS status;
+    int flags; // TERM_F_* of a parsed response
+
+    /*
+     * term_parse_req() points these into the parsed line, no copy;
+     * term_parse_bin_req() into path.
+     */
+    const char* arg; // null-terminated
+    size_t arglen;
 
     const char* msg; // detailed status information;
 };
@@ -39,20 +97,53 @@ term_get_status_desc(int status);
 int
 term_is_valid_method(const char* method);
 
+int
+term_find_method(const char* method, size_t len);
+
+const char*
+term_parse_strerror(int error);
+
 int
 term_parse_req(struct term_req* term_req, const char* buf);
 
-msgsize_t
-term_put_header(char* buf, msgsize_t bufsize, enum TERM_STATUS status,
-        msgsize_t size);
+size_t
+term_put_header(char* buf, size_t bufsize, int rev, enum TERM_STATUS status,
+        msgsize_t size, int flags);
+
+size_t
+term_put_chunk(char* buf, size_t bufsize, msgsize_t size);
+
+size_t
+term_mk_req_header(struct term_req* req, char* buf, size_t bufsize);
+
+int
+term_parse_resp_status(struct term_req* req, char* buf, int rev,
+        msgsize_t* size);
+
+int
+term_parse_chunk(const char* buf, msgsize_t* size);
+
+size_t
+term_bin_reqlen(const char* buf, size_t len);
+
+int
+term_parse_bin_req(struct term_req* req, const char* buf);
+
+size_t
+term_mk_bin_req(const struct term_req* req, char* buf, size_t bufsize);
+
+size_t
+term_put_bin_header(char* buf, size_t bufsize, unsigned short id,
+        enum TERM_STATUS status, msgsize_t size, int flags);
 
 size_t
-term_mk_req_header(struct term_req* req, char* buf, msgsize_t bufsize);
+term_put_bin_chunk(char* buf, size_t bufsize, msgsize_t size);
 
 int
-term_parse_resp_status(struct term_req* req, char* buf);
+term_parse_bin_resp(struct term_req* req, const char* buf,
+        msgsize_t* size);
 
 msgsize_t
-term_parse_resp_body(char* buf);
+term_parse_bin_chunk(const char* buf);
 
 #endif
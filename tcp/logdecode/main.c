@@ -0,0 +1,142 @@
+#include "logger/logrec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DECODE_BUF_SIZE 4096
+
+static char** g_formats;
+static size_t g_nformats;
+
+static void
+print_usage(const char* name)
+{
+    printf("Usage: %s [file]\n"
+           "\tprints a log the server wrote with -f binary,"
+           " reads stdin without a file\n", name);
+}
+
+static int
+define(uint32_t id, const char* format, size_t len)
+{
+    char** formats;
+    size_t n;
+
+    if(g_nformats <= id)
+    {
+        n = (id + 1) * 2;
+        formats = realloc(g_formats, n * sizeof(char*));
+        if(NULL == formats)
+            return -1;
+        memset(formats + g_nformats, 0, (n - g_nformats) * sizeof(char*));
+        g_formats = formats;
+        g_nformats = n;
+    }
+    free(g_formats[id]);
+    g_formats[id] = strndup(format, len);
+    return (NULL == g_formats[id]) ? -1 : 0;
+}
+
+static void
+print_time(uint64_t time)
+{
+    time_t sec = time / 1000000000ull;
+    struct tm tm;
+    char buf[32];
+
+    localtime_r(&sec, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06lu ", buf, (unsigned long) (time % 1000000000ull / 1000));
+}
+
+static int
+decode(FILE* in)
+{
+    struct logrec rec;
+    char data[0x10000];
+    char text[DECODE_BUF_SIZE];
+    int len;
+
+    if(1 != fread(&rec, sizeof(rec), 1, in) || LOGREC_START != rec.r_type
+            || LOGREC_MAGIC != rec.r_id)
+    {
+        fprintf(stderr, "not a binary log of this machine\n");
+        return -1;
+    }
+    if(LOGREC_VERSION != rec.r_time)
+    {
+        fprintf(stderr, "unknown version %llu\n",
+                (unsigned long long) rec.r_time);
+        return -1;
+    }
+
+    while(1 == fread(&rec, sizeof(rec), 1, in))
+    {
+        if(rec.r_len != fread(data, 1, rec.r_len, in))
+        {
+            fprintf(stderr, "the last record is cut\n");
+            return -1;
+        }
+        switch(rec.r_type)
+        {
+            case LOGREC_FORMAT:
+                if(-1 == define(rec.r_id, data, rec.r_len))
+                {
+                    perror("define");
+                    return -1;
+                }
+                break;
+            case LOGREC_ARGS:
+                print_time(rec.r_time);
+                if(g_nformats <= rec.r_id || NULL == g_formats[rec.r_id])
+                {
+                    printf("<unknown format %u>\n", rec.r_id);
+                    break;
+                }
+                len = logrec_render(g_formats[rec.r_id], data, rec.r_len,
+                        text, sizeof(text));
+                fwrite(text, 1, (len < (int) sizeof(text)) ? len
+                        : (int) sizeof(text) - 1, stdout);
+                break;
+            case LOGREC_TEXT:
+                print_time(rec.r_time);
+                fwrite(data, 1, rec.r_len, stdout);
+                break;
+            default:
+                break; // a restart of the log
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    FILE* in = stdin;
+    int rv;
+    size_t i;
+
+    if(2 < argc)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if(2 == argc && NULL == (in = fopen(argv[1], "rb")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    rv = decode(in);
+
+    for(i = 0; i < g_nformats; ++i)
+    {
+        free(g_formats[i]);
+    }
+    free(g_formats);
+    if(stdin != in)
+        fclose(in);
+    return (0 == rv) ? 0 : 1;
+}
@@ -1,206 +1,800 @@
 #include "logger.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-#define LOGGER_BUFFER_SIZE 1024
-#define LOGGER_QUEUE_THRESHOLD 4
-#define LOGGER_SLEEP_TIME 50
-
-struct logdata
+/*
+ * A message in the ring. The sequence tells whose turn it is: it equals
+ * the position when the slot is free to claim, the position + 1 when
+ * the message is ready, and it jumps a lap ahead once it is written.
+ */
+struct slot
 {
-    int ld_isrunning;
-    int ld_isready;
-    char* ld_buffer;
-    pthread_mutex_t ld_mx;
-    pthread_cond_t ld_cv;
+    unsigned long s_seq;
+    int s_len;
+    char s_data[LOGGER_MSG_SIZE];
 };
 
 struct logger
 {
-    int l_buflen;
-    int l_msgcnt;
-    char* l_buffer;
+    /* the producers' end and the writer's end live on their own lines */
+    unsigned long l_head __attribute__((aligned(64)));
+    unsigned long l_tail __attribute__((aligned(64)));
+    unsigned long l_written; // l_tail once it is out
+    unsigned long l_dropped;
+
+    struct slot* l_ring;
+    int l_policy;
+    int l_format;
+    const struct logger_site* l_sites[LOGGER_SITES_MAX]; // by id
+    int l_nsites;
+    int l_defined; // the formats written out so far
+    int l_isstarted; // the start record is out
+    int l_isrunning;
+    int l_issleeping; // the writer waits for messages
+    int l_waiters; // producers waiting for room and flushers
+
+    /* the sink, only the writer touches it once it runs */
+    int l_fd;
+    char* l_path; // NULL for stderr
+    off_t l_size;
+    long l_maxsize;
+    long l_period;
+    long l_sync;
+    uint64_t l_opened; // ms, monotonic
+    uint64_t l_synced;
+    int l_isdirty; // written since the last sync
+
     pthread_t l_tid;
-    pthread_spinlock_t l_sp;
-    struct logdata* l_ld;
+    pthread_mutex_t l_mx;
+    pthread_cond_t l_cv; // wakes the writer up
+    pthread_cond_t l_roomcv; // wakes the waiters up
 };
 
 static struct logger g_logger;
 
+int g_logger_levels[LOGGER_CAT_MAX];
+
+static const char* g_categories[LOGGER_CAT_MAX] = {
+    "accounts", "compress", "dircache", "handler", "listing", "loop",
+    "main", "peer", "pool", "server", "service", "terminal", "who"
+};
+
+static const char* g_levels[] = {"error", "warn", "info", "debug"};
+
+static struct slot*
+slot_at(struct logger* lg, unsigned long pos)
+{
+    return &lg->l_ring[pos & (LOGGER_RING_SIZE - 1)];
+}
+
+/**
+ * Claims the slot at the head. Producers race only with each other,
+ * so a failed CAS means someone else has just claimed. Returns NULL
+ * if the ring is full.
+ */
+static struct slot*
+claim(struct logger* lg, unsigned long* pos)
+{
+    struct slot* s;
+    long dif;
+
+    *pos = __sync_fetch_and_or(&lg->l_head, 0);
+    for(;;)
+    {
+        s = slot_at(lg, *pos);
+        dif = (long) (__sync_fetch_and_or(&s->s_seq, 0) - *pos);
+        if(0 == dif && __sync_bool_compare_and_swap(&lg->l_head,
+                    *pos, *pos + 1))
+            return s;
+        if(0 > dif)
+            return NULL;
+        *pos = __sync_fetch_and_or(&lg->l_head, 0);
+    }
+}
+
+static int
+isfull(struct logger* lg)
+{
+    unsigned long pos = __sync_fetch_and_or(&lg->l_head, 0);
+    return 0 > (long) (__sync_fetch_and_or(&slot_at(lg, pos)->s_seq, 0) - pos);
+}
+
 static void
-swapbufs(char** a, char** b)
+wakewriter(struct logger* lg)
 {
-    char* tmp = *a;
-    *a = *b;
-    *b = tmp;
+    pthread_mutex_lock(&lg->l_mx);
+    pthread_cond_signal(&lg->l_cv);
+    pthread_mutex_unlock(&lg->l_mx);
 }
 
 static void
-waitfor(int* condition)
+waitroom(struct logger* lg)
 {
-    while(1 == __sync_and_and_fetch(condition, 1))
+    pthread_mutex_lock(&lg->l_mx);
+    __sync_add_and_fetch(&lg->l_waiters, 1);
+    while(isfull(lg) && __sync_fetch_and_or(&lg->l_isrunning, 0))
     {
-        usleep(LOGGER_SLEEP_TIME);
+        pthread_cond_signal(&lg->l_cv);
+        pthread_cond_wait(&lg->l_roomcv, &lg->l_mx);
     }
+    __sync_sub_and_fetch(&lg->l_waiters, 1);
+    pthread_mutex_unlock(&lg->l_mx);
 }
 
-void
-logger_log(const char* format, ...)
+/**
+ * Returns the id of the site or -1 if it is logged as text.
+ */
+static int
+site_id(struct logger* lg, struct logger_site* site, const char* format)
+{
+    int id = __sync_fetch_and_or(&site->ls_id, 0);
+
+    if(0 == id)
+    {
+        pthread_mutex_lock(&lg->l_mx);
+        if(0 == __sync_fetch_and_or(&site->ls_id, 0))
+        {
+            site->ls_format = format;
+            site->ls_nkinds = logrec_parse(format, site->ls_kinds);
+            if(0 <= site->ls_nkinds && LOGGER_SITES_MAX > lg->l_nsites
+                    && LOGGER_MSG_SIZE > strlen(format))
+            {
+                lg->l_sites[lg->l_nsites++] = site;
+                __sync_fetch_and_add(&site->ls_id, lg->l_nsites);
+            }
+            else
+            {
+                __sync_fetch_and_sub(&site->ls_id, 1);
+            }
+        }
+        id = __sync_fetch_and_or(&site->ls_id, 0);
+        pthread_mutex_unlock(&lg->l_mx);
+    }
+    return (0 < id) ? id - 1 : -1;
+}
+
+/**
+ * Marks a message vsnprintf has cut. Returns its length.
+ */
+static int
+cut(char* data, int len, int size)
+{
+    if(size <= len)
+    {
+        memcpy(data + size - 7, "<...>\n", 6);
+        len = size - 1;
+    }
+    return (0 < len) ? len : 0;
+}
+
+static uint64_t
+now()
 {
-    static const int limit = LOGGER_BUFFER_SIZE;
+    struct timespec ts;
 
-    pthread_spin_lock(&g_logger.l_sp);
-    
-    struct logdata* ld = g_logger.l_ld;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Fills the slot with a record. The arguments are only copied unless
+ * the format has to be logged as text.
+ */
+static int
+put_record(struct slot* s, int id, const struct logger_site* site,
+        const char* format, va_list args)
+{
+    struct logrec rec;
+    char* data = s->s_data + sizeof(rec);
+    int len;
 
-    // if logger_loop has not handled messages yet
-    waitfor(&ld->ld_isready);
+    rec.r_time = now();
+    rec.r_pad = 0;
+    if(0 <= id)
+    {
+        rec.r_type = LOGREC_ARGS;
+        rec.r_id = id;
+        len = logrec_pack(site->ls_kinds, site->ls_nkinds, args, data,
+                LOGGER_MSG_SIZE - sizeof(rec));
+    }
+    else
+    {
+        rec.r_type = LOGREC_TEXT;
+        rec.r_id = 0;
+        len = vsnprintf(data, LOGGER_MSG_SIZE - sizeof(rec), format, args);
+        len = cut(data, len, LOGGER_MSG_SIZE - sizeof(rec));
+    }
+    rec.r_len = len;
+    memcpy(s->s_data, &rec, sizeof(rec));
+    return sizeof(rec) + len;
+}
 
+/**
+ * Peer threads are cancelled, but not in here: a claimed slot would
+ * never be ready and stop the writer, a wait would leave l_mx locked.
+ */
+void
+logger_write(struct logger_site* site, const char* format, ...)
+{
+    struct logger* lg = &g_logger;
+    struct slot* s;
+    unsigned long pos;
     va_list args;
-    int bytes;
-    int* buflen = &g_logger.l_buflen;
-    int bytesleft = limit - *buflen;
-    int* msgcnt = &g_logger.l_msgcnt;
-    char** buf = &g_logger.l_buffer;
-    int wastruncated = 0;
+    int id = -1;
+    int state;
+
+    if(NULL == lg->l_ring)
+        return;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    if(LOGGER_TEXT != lg->l_format)
+        id = site_id(lg, site, format);
+    while(NULL == (s = claim(lg, &pos)))
+    {
+        if(LOGGER_BLOCK != lg->l_policy
+                || !__sync_fetch_and_or(&lg->l_isrunning, 0))
+        {
+            __sync_add_and_fetch(&lg->l_dropped, 1);
+            pthread_setcancelstate(state, NULL);
+            return;
+        }
+        waitroom(lg);
+    }
 
     va_start(args, format);
-    bytes = vsnprintf(*buf + *buflen, bytesleft, format, args);
+    if(LOGGER_TEXT == lg->l_format)
+    {
+        s->s_len = cut(s->s_data,
+                vsnprintf(s->s_data, LOGGER_MSG_SIZE, format, args),
+                LOGGER_MSG_SIZE);
+    }
+    else
+    {
+        s->s_len = put_record(s, id, site, format, args);
+    }
     va_end(args);
-    *buflen += bytes;
+    __sync_add_and_fetch(&s->s_seq, 1); // it is ready
+
+    if(__sync_fetch_and_or(&lg->l_issleeping, 0))
+        wakewriter(lg);
+    pthread_setcancelstate(state, NULL);
+}
+
+/**
+ * Puts a record into out unless there is no room.
+ */
+static int
+put_raw(char* out, size_t room, size_t* n, int type, int id,
+        uint64_t time, const char* data, size_t len)
+{
+    struct logrec rec;
+
+    if(room - *n < sizeof(rec) + len)
+        return -1;
+    rec.r_len = len;
+    rec.r_type = type;
+    rec.r_pad = 0;
+    rec.r_id = id;
+    rec.r_time = time;
+    memcpy(out + *n, &rec, sizeof(rec));
+    memcpy(out + *n + sizeof(rec), data, len);
+    *n += sizeof(rec) + len;
+    return 0;
+}
+
+/**
+ * Puts a line of the writer's own into out.
+ */
+static int
+put_text(struct logger* lg, char* out, size_t room, size_t* n,
+        const char* text, size_t len)
+{
+    if(LOGGER_BINARY == lg->l_format)
+        return put_raw(out, room, n, LOGREC_TEXT, 0, now(), text, len);
+    if(room - *n < len)
+        return -1;
+    memcpy(out + *n, text, len);
+    *n += len;
+    return 0;
+}
+
+/**
+ * Puts the message of the slot into out: as it is, rendered or in
+ * binary after the formats it needs. Returns -1 if it does not fit,
+ * the formats put so far stay.
+ */
+static int
+put_slot(struct logger* lg, const struct slot* s, char* out, size_t room,
+        size_t* n)
+{
+    struct logrec rec;
+    const char* format;
 
-    if(bytes >= bytesleft)
+    if(LOGGER_TEXT == lg->l_format)
+        return put_text(lg, out, room, n, s->s_data, s->s_len);
+
+    memcpy(&rec, s->s_data, sizeof(rec));
+    if(LOGGER_BINARY == lg->l_format)
     {
-        sprintf(*buf + limit - 7, "<...>\n");
-        wastruncated = 1;
+        while(LOGREC_ARGS == rec.r_type && lg->l_defined <= (int) rec.r_id)
+        {
+            format = lg->l_sites[lg->l_defined]->ls_format;
+            if(-1 == put_raw(out, room, n, LOGREC_FORMAT, lg->l_defined,
+                        rec.r_time, format, strlen(format)))
+                return -1;
+            ++lg->l_defined;
+        }
+        if(room - *n < (size_t) s->s_len)
+            return -1;
+        memcpy(out + *n, s->s_data, s->s_len);
+        *n += s->s_len;
+        return 0;
     }
 
-    if(LOGGER_QUEUE_THRESHOLD == ++(*msgcnt) || 1 == wastruncated)
+    if(LOGREC_TEXT == rec.r_type)
+        return put_text(lg, out, room, n, s->s_data + sizeof(rec), rec.r_len);
+    if(room - *n < LOGGER_MSG_SIZE)
+        return -1;
+    format = lg->l_sites[rec.r_id]->ls_format;
+    *n += cut(out + *n, logrec_render(format, s->s_data + sizeof(rec),
+                rec.r_len, out + *n, LOGGER_MSG_SIZE), LOGGER_MSG_SIZE);
+    return 0;
+}
+
+/**
+ * Moves the ready messages to the batch and frees their slots.
+ */
+static size_t
+drain(struct logger* lg, char* batch)
+{
+    size_t len = 0;
+    unsigned long dropped = __sync_fetch_and_and(&lg->l_dropped, 0);
+    struct slot* s = slot_at(lg, lg->l_tail);
+    char text[64];
+
+    if(LOGGER_BINARY == lg->l_format && !lg->l_isstarted)
     {
-        *msgcnt = 0;
-        *buflen = 0;
+        put_raw(batch, LOGGER_BATCH_SIZE, &len, LOGREC_START, LOGREC_MAGIC,
+                LOGREC_VERSION, "", 0);
+        lg->l_isstarted = 1;
+    }
+    if(0 < dropped)
+    {
+        put_text(lg, batch, LOGGER_BATCH_SIZE, &len, text, sprintf(text,
+                    "[logger] %lu messages dropped\n", dropped));
+    }
 
-        pthread_mutex_lock(&ld->ld_mx);
-        swapbufs(buf, &ld->ld_buffer);
-        ld->ld_isready = 1;
-        pthread_cond_signal(&ld->ld_cv);
-        pthread_mutex_unlock(&ld->ld_mx);       
+    while(__sync_fetch_and_or(&s->s_seq, 0) == lg->l_tail + 1
+            && 0 == put_slot(lg, s, batch, LOGGER_BATCH_SIZE, &len))
+    {
+        __sync_add_and_fetch(&s->s_seq, LOGGER_RING_SIZE - 1);
+        s = slot_at(lg, ++lg->l_tail);
     }
+    return len;
+}
 
-    pthread_spin_unlock(&g_logger.l_sp);
+static uint64_t
+clock_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
 }
 
-static void*
-logger_loop(void* p_logdata)
+static int
+open_sink(struct logger* lg)
 {
-    struct logdata* ld = (struct logdata*) p_logdata;
+    struct stat st;
+    int fd = open(lg->l_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+
+    if(-1 == fd)
+        return -1;
+    lg->l_size = (0 == fstat(fd, &st)) ? st.st_size : 0;
+    lg->l_opened = clock_ms();
+    lg->l_fd = fd;
+    return 0;
+}
 
-    __sync_add_and_fetch(&ld->ld_isrunning, 1);
-    while(__sync_fetch_and_or(&ld->ld_isrunning, 0))
+/**
+ * Renames the file to <path>.<date>-<time>, with a number if it is
+ * taken, and starts a new one. If that fails the old one is used
+ * till the next limit.
+ */
+static void
+rotate(struct logger* lg)
+{
+    char name[PATH_MAX];
+    time_t t = time(NULL);
+    struct tm tm;
+    struct stat st;
+    int oldfd = lg->l_fd;
+    size_t n;
+    int isnamed;
+    int i;
+
+    localtime_r(&t, &tm);
+    n = snprintf(name, sizeof(name), "%s.", lg->l_path);
+    isnamed = (n + 32 < sizeof(name)); // room for the date and number
+    if(isnamed)
     {
-        pthread_mutex_lock(&ld->ld_mx);
-        while(0 == __sync_fetch_and_or(&ld->ld_isready, 0))
+        n += strftime(name + n, sizeof(name) - n, "%Y%m%d-%H%M%S", &tm);
+        for(i = 1; 0 == stat(name, &st); ++i)
         {
-            pthread_cond_wait(&ld->ld_cv, &ld->ld_mx);
+            sprintf(name + n, ".%d", i);
         }
-        if(__sync_fetch_and_or(&ld->ld_isrunning, 0))
-            fprintf(stderr, ld->ld_buffer);
-        __sync_and_and_fetch(&ld->ld_isready, 0);
-        pthread_mutex_unlock(&ld->ld_mx);
     }
 
-    pthread_exit(NULL);
+    if(0 < lg->l_sync)
+        fdatasync(oldfd);
+    if(!isnamed || 0 != rename(lg->l_path, name)
+            || -1 == open_sink(lg))
+    {
+        lg->l_size = 0;
+        lg->l_opened = clock_ms();
+        return;
+    }
+    close(oldfd);
+    lg->l_isdirty = 0;
+    // a binary log starts over in the new file
+    lg->l_isstarted = 0;
+    lg->l_defined = 0;
 }
 
+/**
+ * Rotates the file and syncs it when it is time to.
+ */
 static void
-logger_data_init(struct logdata* logbundle)
+maintain(struct logger* lg)
 {
-    logbundle->ld_isready = 0;
-    logbundle->ld_isrunning = 0;
-    logbundle->ld_buffer = ((char*) (logbundle)) + sizeof(struct logdata);
+    uint64_t now = clock_ms();
+
+    if(NULL != lg->l_path && 0 < lg->l_size
+            && ((0 < lg->l_maxsize && lg->l_maxsize <= lg->l_size)
+                || (0 < lg->l_period
+                    && lg->l_opened + lg->l_period <= now)))
+        rotate(lg);
+    if(lg->l_isdirty && 0 < lg->l_sync && lg->l_synced + lg->l_sync <= now)
+    {
+        fdatasync(lg->l_fd);
+        lg->l_synced = now;
+        lg->l_isdirty = 0;
+    }
+}
+
+/**
+ * Returns how long the writer may sleep in ms, -1 for as long as
+ * there are no messages.
+ */
+static long
+sleeptime(struct logger* lg)
+{
+    uint64_t now = clock_ms();
+    long wait = -1;
+    long period;
+    uint64_t at;
 
-    pthread_mutex_init(&logbundle->ld_mx, NULL);
-    pthread_cond_init(&logbundle->ld_cv, NULL);
+    if(lg->l_isdirty && 0 < lg->l_sync)
+    {
+        at = lg->l_synced + lg->l_sync;
+        wait = (now < at) ? (long) (at - now) : 0;
+    }
+    if(NULL != lg->l_path && 0 < lg->l_size && 0 < lg->l_period)
+    {
+        at = lg->l_opened + lg->l_period;
+        period = (now < at) ? (long) (at - now) : 0;
+        if(-1 == wait || period < wait)
+            wait = period;
+    }
+    return wait;
 }
 
-void
-logger_init()
+static void
+writeall(int fd, struct iovec* iov, int n)
 {
-    struct logger* p = &g_logger;
-    if(0 == p->l_tid)
+    ssize_t len;
+
+    while(0 < n)
     {
-        p->l_ld = malloc(sizeof(struct logdata) + 2 * LOGGER_BUFFER_SIZE);
-        memset(p->l_ld, 0, sizeof(struct logdata) + 2 * LOGGER_BUFFER_SIZE);
-        logger_data_init(p->l_ld);
+        len = writev(fd, iov, n);
+        if(-1 == len && EINTR == errno)
+            continue;
+        if(0 >= len)
+            return;
+        for(; 0 < n && (size_t) len >= iov->iov_len; --n, ++iov)
+        {
+            len -= iov->iov_len;
+        }
+        if(0 < n)
+        {
+            iov->iov_base = (char*) iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+}
 
-        p->l_buflen = 0;
-        p->l_msgcnt = 0;
-        p->l_buffer = p->l_ld->ld_buffer + LOGGER_BUFFER_SIZE;
-        pthread_spin_init(&p->l_sp, PTHREAD_PROCESS_PRIVATE);
+/**
+ * Sleeps until a message comes or there is a file to maintain.
+ */
+static void
+sleep_writer(struct logger* lg)
+{
+    long wait = sleeptime(lg);
+    struct timespec ts;
 
-        pthread_create(&p->l_tid, NULL, logger_loop, p->l_ld);
+    if(-1 == wait)
+    {
+        pthread_cond_wait(&lg->l_cv, &lg->l_mx);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += wait / 1000;
+    ts.tv_nsec += (wait % 1000) * 1000000;
+    if(1000000000 <= ts.tv_nsec)
+    {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000;
     }
+    pthread_cond_timedwait(&lg->l_cv, &lg->l_mx, &ts);
 }
 
 static void
-logger_data_destroy(struct logdata* logbundle)
+close_sink(struct logger* lg)
 {
-    pthread_mutex_destroy(&logbundle->ld_mx);
-    pthread_cond_destroy(&logbundle->ld_cv);
+    if(NULL != lg->l_path)
+    {
+        close(lg->l_fd);
+        free(lg->l_path);
+        lg->l_path = NULL;
+    }
+    lg->l_fd = STDERR_FILENO;
 }
 
-void
-logger_flush()
+static void*
+logger_loop(void* p_logger)
+{
+    struct logger* lg = (struct logger*) p_logger;
+    char* batch = malloc(LOGGER_BATCHES * LOGGER_BATCH_SIZE);
+    struct iovec iov[LOGGER_BATCHES];
+    size_t len;
+    int n;
+
+    for(;;)
+    {
+        maintain(lg);
+        for(n = 0, len = 0; NULL != batch && n < LOGGER_BATCHES; ++n)
+        {
+            iov[n].iov_base = batch + n * LOGGER_BATCH_SIZE;
+            iov[n].iov_len = drain(lg, iov[n].iov_base);
+            if(0 == iov[n].iov_len)
+                break;
+            len += iov[n].iov_len;
+        }
+        if(0 < len)
+        {
+            writeall(lg->l_fd, iov, n);
+            lg->l_size += len;
+            lg->l_isdirty = 1;
+            // only this thread moves it, the flushers wait for it
+            __sync_fetch_and_add(&lg->l_written, lg->l_tail - lg->l_written);
+            if(0 < __sync_fetch_and_or(&lg->l_waiters, 0))
+            {
+                pthread_mutex_lock(&lg->l_mx);
+                pthread_cond_broadcast(&lg->l_roomcv);
+                pthread_mutex_unlock(&lg->l_mx);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&lg->l_mx);
+        if(!__sync_fetch_and_or(&lg->l_isrunning, 0))
+        {
+            pthread_mutex_unlock(&lg->l_mx);
+            break;
+        }
+        __sync_fetch_and_or(&lg->l_issleeping, 1);
+        // a message published before the flag was seen is here by now
+        if(__sync_fetch_and_or(&slot_at(lg, lg->l_tail)->s_seq, 0)
+                != lg->l_tail + 1
+                && 0 == __sync_fetch_and_or(&lg->l_dropped, 0))
+            sleep_writer(lg);
+        __sync_fetch_and_and(&lg->l_issleeping, 0);
+        pthread_mutex_unlock(&lg->l_mx);
+    }
+
+    if(lg->l_isdirty && 0 < lg->l_sync)
+        fdatasync(lg->l_fd);
+    free(batch);
+    pthread_mutex_lock(&lg->l_mx);
+    pthread_cond_broadcast(&lg->l_roomcv);
+    pthread_mutex_unlock(&lg->l_mx);
+    return NULL;
+}
+
+int
+logger_init(const struct logger_opts* opts)
+{
+    struct logger* lg = &g_logger;
+    pthread_condattr_t attr;
+    unsigned long i;
+
+    if(NULL != lg->l_ring)
+        return 0;
+
+    lg->l_fd = STDERR_FILENO;
+    lg->l_path = NULL;
+    lg->l_size = 0;
+    if(NULL != opts->lo_path)
+    {
+        lg->l_path = strdup(opts->lo_path);
+        if(NULL == lg->l_path || -1 == open_sink(lg))
+        {
+            free(lg->l_path);
+            lg->l_path = NULL;
+            return -1;
+        }
+    }
+    lg->l_maxsize = opts->lo_maxsize;
+    lg->l_period = opts->lo_period;
+    lg->l_sync = opts->lo_sync;
+    lg->l_synced = clock_ms();
+    lg->l_isdirty = 0;
+
+    lg->l_ring = malloc(LOGGER_RING_SIZE * sizeof(struct slot));
+    if(NULL == lg->l_ring)
+    {
+        close_sink(lg);
+        return 0;
+    }
+    for(i = 0; i < LOGGER_RING_SIZE; ++i)
+    {
+        lg->l_ring[i].s_seq = i;
+    }
+    lg->l_head = 0;
+    lg->l_tail = 0;
+    lg->l_written = 0;
+    lg->l_dropped = 0;
+    lg->l_policy = opts->lo_policy;
+    lg->l_format = opts->lo_format;
+    lg->l_nsites = 0;
+    lg->l_defined = 0;
+    lg->l_isstarted = 0;
+    for(i = 0; i < LOGGER_CAT_MAX; ++i)
+    {
+        g_logger_levels[i] = LOGGER_LEVEL_DEFAULT;
+    }
+    lg->l_issleeping = 0;
+    lg->l_waiters = 0;
+    lg->l_isrunning = 1;
+    pthread_mutex_init(&lg->l_mx, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lg->l_cv, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&lg->l_roomcv, NULL);
+
+    if(0 != pthread_create(&lg->l_tid, NULL, logger_loop, lg))
+    {
+        pthread_mutex_destroy(&lg->l_mx);
+        pthread_cond_destroy(&lg->l_cv);
+        pthread_cond_destroy(&lg->l_roomcv);
+        free(lg->l_ring);
+        lg->l_ring = NULL;
+        close_sink(lg);
+    }
+    return 0;
+}
+
+static int
+find(const char** names, int n, const char* name)
+{
+    int i;
+
+    for(i = 0; i < n; ++i)
+    {
+        if(0 == strcmp(names[i], name))
+            return i;
+    }
+    return -1;
+}
+
+int
+logger_setlevel(const char* category, const char* level)
 {
-    pthread_spin_lock(&g_logger.l_sp);
-    struct logdata* ld = g_logger.l_ld;
-    int* buflen = &g_logger.l_buflen;
-    
-    waitfor(&ld->ld_isready);
+    int cat = -1;
+    int lvl = find(g_levels, sizeof(g_levels) / sizeof(*g_levels), level);
+    int i;
 
-    if(0 < *buflen)
+    if(NULL != category)
     {
-        int* msgcnt = &g_logger.l_msgcnt;
-        char** buf = &g_logger.l_buffer;
+        cat = find(g_categories, LOGGER_CAT_MAX, category);
+        if(-1 == cat)
+            return -1;
+    }
+    if(-1 == lvl)
+        return -1;
+
+    for(i = 0; i < LOGGER_CAT_MAX; ++i)
+    {
+        if(-1 == cat || i == cat)
+            __atomic_store_n(&g_logger_levels[i], lvl, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
 
-        *buflen = 0;
-        *msgcnt = 0;
+void
+logger_printlevels()
+{
+    int i;
 
-        pthread_mutex_lock(&ld->ld_mx);  
-        swapbufs(buf, &ld->ld_buffer);
-        ld->ld_isready = 1;
-        pthread_cond_signal(&ld->ld_cv);
-        pthread_mutex_unlock(&ld->ld_mx);  
+    printf("Log levels (compiled up to %s):", g_levels[LOGGER_LEVEL]);
+    for(i = 0; i < LOGGER_CAT_MAX; ++i)
+    {
+        printf(" %s=%s", g_categories[i], g_levels[__atomic_load_n(
+                    &g_logger_levels[i], __ATOMIC_RELAXED)]);
+    }
+    printf("\n");
+}
 
-        waitfor(&ld->ld_isready);
+/**
+ * Waits until the messages logged so far are written.
+ */
+void
+logger_flush()
+{
+    struct logger* lg = &g_logger;
+    unsigned long head;
+    int state;
+
+    if(NULL == lg->l_ring)
+        return;
+
+    head = __sync_fetch_and_or(&lg->l_head, 0);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&lg->l_mx);
+    __sync_add_and_fetch(&lg->l_waiters, 1);
+    while(0 > (long) (__sync_fetch_and_or(&lg->l_written, 0) - head)
+            && __sync_fetch_and_or(&lg->l_isrunning, 0))
+    {
+        pthread_cond_signal(&lg->l_cv);
+        pthread_cond_wait(&lg->l_roomcv, &lg->l_mx);
     }
-    pthread_spin_unlock(&g_logger.l_sp);
+    __sync_sub_and_fetch(&lg->l_waiters, 1);
+    pthread_mutex_unlock(&lg->l_mx);
+    pthread_setcancelstate(state, NULL);
 }
 
 void
 logger_destroy()
 {
-    struct logger* p = &g_logger;
-    
-    if(0 != p->l_tid)
+    struct logger* lg = &g_logger;
+
+    if(NULL != lg->l_ring)
     {
         logger_flush();
 
-        pthread_mutex_lock(&p->l_ld->ld_mx);
-        __sync_add_and_fetch(&p->l_ld->ld_isready, 1);
-        __sync_sub_and_fetch(&p->l_ld->ld_isrunning, 1);
-        pthread_cond_signal(&p->l_ld->ld_cv);
-        pthread_mutex_unlock(&p->l_ld->ld_mx);
-        pthread_join(p->l_tid, NULL);
-
-        logger_data_destroy(p->l_ld);
-        pthread_spin_destroy(&p->l_sp);
-        free(p->l_ld);
-        p->l_tid = 0;
+        pthread_mutex_lock(&lg->l_mx);
+        __sync_fetch_and_and(&lg->l_isrunning, 0);
+        pthread_cond_signal(&lg->l_cv);
+        pthread_mutex_unlock(&lg->l_mx);
+        pthread_join(lg->l_tid, NULL);
+
+        pthread_mutex_destroy(&lg->l_mx);
+        pthread_cond_destroy(&lg->l_cv);
+        pthread_cond_destroy(&lg->l_roomcv);
+        free(lg->l_ring);
+        lg->l_ring = NULL;
+        close_sink(lg);
     }
 }
@@ -1,14 +1,149 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include "logrec.h"
+
+#define LOGGER_RING_SIZE 4096 // messages, a power of two
+#define LOGGER_MSG_SIZE 256 // a longer message is cut
+#define LOGGER_BATCH_SIZE (64 * 1024) // a chunk of the writer's buffer
+#define LOGGER_BATCHES 8 // chunks written by one writev()
+#define LOGGER_SITES_MAX 1024 // the rest are logged as text
+
+/**
+ * What logger_log() does when the writer lags behind and the ring is
+ * full.
+ */
+enum logger_policy
+{
+    LOGGER_DROP, // the message is dropped and counted
+    LOGGER_BLOCK // the caller waits for room
+};
+
+/**
+ * What the writer gets. In the deferred formats a message is the id of
+ * its format, a timestamp and the raw arguments, see logrec.h. The
+ * writer renders them in LOGGER_DEFERRED and writes them out as they are
+ * in LOGGER_BINARY, for logdecode.
+ */
+enum logger_format
+{
+    LOGGER_TEXT,
+    LOGGER_DEFERRED,
+    LOGGER_BINARY
+};
+
+struct logger_opts
+{
+    int lo_policy;
+    int lo_format;
+    const char* lo_path; // stderr if NULL
+    long lo_maxsize; // bytes, a bigger file is rotated, 0 for no limit
+    long lo_period; // ms, an older file is rotated, 0 for no limit
+    long lo_sync; // ms between fdatasync() calls, 0 for none
+};
+
+/*
+ * A logger_log() statement. The deferred formats register it on the
+ * first call, then its arguments are packed by the kinds.
+ */
+struct logger_site
+{
+    const char* ls_format;
+    int ls_id; // 0 until registered, then the id + 1 or -1 for text
+    int ls_nkinds;
+    unsigned char ls_kinds[LOGREC_ARGS_MAX];
+};
+
+/*
+ * The format must be a string literal, the writer may render it later.
+ */
+#define logger_log(...) \
+    do \
+    { \
+        static struct logger_site logger_site_; \
+        logger_write(&logger_site_, __VA_ARGS__); \
+    } while(0)
+
+/*
+ * Statements above LOGGER_LEVEL are not compiled in, build with
+ * -DLOGGER_LEVEL=LOGGER_INFO to drop the debug ones. The rest cost a
+ * load and a branch when the level of their category is lower.
+ */
+#define LOGGER_ERROR 0
+#define LOGGER_WARN 1
+#define LOGGER_INFO 2
+#define LOGGER_DEBUG 3
+
+#ifndef LOGGER_LEVEL
+#define LOGGER_LEVEL LOGGER_DEBUG
+#endif
+
+#define LOGGER_LEVEL_DEFAULT LOGGER_INFO
+
+enum logger_category
+{
+    LOGGER_CAT_ACCOUNTS,
+    LOGGER_CAT_COMPRESS,
+    LOGGER_CAT_DIRCACHE,
+    LOGGER_CAT_HANDLER,
+    LOGGER_CAT_LISTING,
+    LOGGER_CAT_LOOP,
+    LOGGER_CAT_MAIN,
+    LOGGER_CAT_PEER,
+    LOGGER_CAT_POOL,
+    LOGGER_CAT_SERVER,
+    LOGGER_CAT_SERVICE,
+    LOGGER_CAT_TERMINAL,
+    LOGGER_CAT_WHO,
+    LOGGER_CAT_MAX
+};
+
+extern int g_logger_levels[LOGGER_CAT_MAX];
+
+/*
+ * A file using these defines LOGGER_CATEGORY, its statements belong to
+ * it.
+ */
+#define logger_at(level, ...) \
+    do \
+    { \
+        if(LOGGER_LEVEL >= (level) && (level) <= __atomic_load_n( \
+                    &g_logger_levels[LOGGER_CATEGORY], __ATOMIC_RELAXED)) \
+            logger_log(__VA_ARGS__); \
+    } while(0)
+
+#define logger_error(...) logger_at(LOGGER_ERROR, __VA_ARGS__)
+#define logger_warn(...) logger_at(LOGGER_WARN, __VA_ARGS__)
+#define logger_info(...) logger_at(LOGGER_INFO, __VA_ARGS__)
+#define logger_debug(...) logger_at(LOGGER_DEBUG, __VA_ARGS__)
+
+/**
+ * Sets the level of the category by their names, of all categories
+ * without one. Returns -1 if a name is unknown.
+ */
+int
+logger_setlevel(const char* category, const char* level);
+
+/**
+ * Prints the levels of the categories to stdout.
+ */
 void
-logger_log(const char* format, ...);
+logger_printlevels();
 
 void
-logger_flush();
+logger_write(struct logger_site* site, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
 
 void
-logger_init();
+logger_flush();
+
+/**
+ * Starts the writer. A file is opened with O_APPEND, a rotated one is
+ * renamed to <path>.<date>-<time>. Returns -1 if the file cannot be
+ * opened.
+ */
+int
+logger_init(const struct logger_opts* opts);
 
 void
 logger_destroy();
@@ -0,0 +1,452 @@
+#include "logrec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPEC_SIZE 32 // a longer conversion is not supported
+#define STR_NULL 0xffff // the length of a NULL string
+
+enum
+{
+    STAR_WIDTH = 0x1,
+    STAR_PRECISION = 0x2
+};
+
+/*
+ * One conversion of a format: from '%' to the conversion character.
+ */
+struct spec
+{
+    const char* sp_start;
+    size_t sp_len;
+    int sp_stars;
+    int sp_kind; // -1 for "%%"
+};
+
+static int
+kind_of(char conv, const char* len)
+{
+    switch(conv)
+    {
+        case 'd':
+        case 'i':
+            if('\0' == len[0] || 'h' == len[0])
+                return LOGREC_INT;
+            if('l' == len[0])
+                return ('l' == len[1]) ? LOGREC_LLONG : LOGREC_LONG;
+            if('q' == len[0])
+                return LOGREC_LLONG;
+            if('z' == len[0])
+                return LOGREC_SIZE;
+            if('j' == len[0])
+                return LOGREC_INTMAX;
+            if('t' == len[0])
+                return LOGREC_PTRDIFF;
+            return -1;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            if('\0' == len[0] || 'h' == len[0])
+                return LOGREC_UINT;
+            if('l' == len[0])
+                return ('l' == len[1]) ? LOGREC_ULLONG : LOGREC_ULONG;
+            if('q' == len[0])
+                return LOGREC_ULLONG;
+            if('z' == len[0])
+                return LOGREC_SIZE;
+            if('j' == len[0])
+                return LOGREC_UINTMAX;
+            if('t' == len[0])
+                return LOGREC_PTRDIFF;
+            return -1;
+        case 'c':
+            return ('\0' == len[0]) ? LOGREC_INT : -1;
+        case 's':
+            return ('\0' == len[0]) ? LOGREC_STR : -1;
+        case 'p':
+            return ('\0' == len[0]) ? LOGREC_PTR : -1;
+        case 'a':
+        case 'A':
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+            if('\0' == len[0] || ('l' == len[0] && '\0' == len[1]))
+                return LOGREC_DOUBLE;
+            return ('L' == len[0]) ? LOGREC_LDOUBLE : -1;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Reads the conversion at p, which points to '%'. Returns -1 if it is
+ * not supported.
+ */
+static int
+read_spec(const char* p, struct spec* sp)
+{
+    const char* start = p++;
+    char len[3] = "";
+    int n = 0;
+
+    sp->sp_start = start;
+    sp->sp_stars = 0;
+    if('%' == *p)
+    {
+        sp->sp_len = 2;
+        sp->sp_kind = -1;
+        return 0;
+    }
+
+    p += strspn(p, "-+ #0'");
+    if('*' == *p)
+    {
+        sp->sp_stars |= STAR_WIDTH;
+        ++p;
+    }
+    else
+    {
+        p += strspn(p, "0123456789");
+    }
+    if('$' == *p)
+        return -1; // positional arguments
+    if('.' == *p)
+    {
+        ++p;
+        if('*' == *p)
+        {
+            sp->sp_stars |= STAR_PRECISION;
+            ++p;
+        }
+        else
+        {
+            p += strspn(p, "0123456789");
+        }
+    }
+    while(NULL != strchr("hlqLzjt", *p) && '\0' != *p && 2 > n)
+    {
+        len[n++] = *p++;
+    }
+
+    sp->sp_kind = kind_of(*p, len);
+    sp->sp_len = p + 1 - start;
+    if(0 > sp->sp_kind || SPEC_SIZE <= sp->sp_len)
+        return -1;
+    return 0;
+}
+
+int
+logrec_parse(const char* format, unsigned char* kinds)
+{
+    struct spec sp;
+    int n = 0;
+
+    while(NULL != (format = strchr(format, '%')))
+    {
+        if(-1 == read_spec(format, &sp))
+            return -1;
+        format += sp.sp_len;
+        if(0 > sp.sp_kind)
+            continue;
+
+        if(LOGREC_ARGS_MAX < n + 1 + !!(sp.sp_stars & STAR_WIDTH)
+                + !!(sp.sp_stars & STAR_PRECISION))
+            return -1;
+        if(sp.sp_stars & STAR_WIDTH)
+            kinds[n++] = LOGREC_INT;
+        if(sp.sp_stars & STAR_PRECISION)
+            kinds[n++] = LOGREC_INT;
+        kinds[n++] = sp.sp_kind;
+    }
+    return n;
+}
+
+static int
+put(char* buf, size_t* len, size_t size, const void* data, size_t n)
+{
+    if(size - *len < n)
+        return -1;
+    memcpy(buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+size_t
+logrec_pack(const unsigned char* kinds, int nkinds, va_list args,
+        char* buf, size_t size)
+{
+    size_t len = 0;
+    int64_t i;
+    uint64_t u;
+    double d;
+    long double ld;
+    const char* s;
+    uint16_t slen;
+    size_t n;
+    int k;
+    int rv = 0;
+
+    for(k = 0; k < nkinds && 0 == rv; ++k)
+    {
+        switch(kinds[k])
+        {
+            case LOGREC_INT:
+                i = va_arg(args, int);
+                rv = put(buf, &len, size, &i, sizeof(i));
+                break;
+            case LOGREC_UINT:
+                u = va_arg(args, unsigned int);
+                rv = put(buf, &len, size, &u, sizeof(u));
+                break;
+            case LOGREC_LONG:
+                i = va_arg(args, long);
+                rv = put(buf, &len, size, &i, sizeof(i));
+                break;
+            case LOGREC_ULONG:
+                u = va_arg(args, unsigned long);
+                rv = put(buf, &len, size, &u, sizeof(u));
+                break;
+            case LOGREC_LLONG:
+                i = va_arg(args, long long);
+                rv = put(buf, &len, size, &i, sizeof(i));
+                break;
+            case LOGREC_ULLONG:
+                u = va_arg(args, unsigned long long);
+                rv = put(buf, &len, size, &u, sizeof(u));
+                break;
+            case LOGREC_SIZE:
+                u = va_arg(args, size_t);
+                rv = put(buf, &len, size, &u, sizeof(u));
+                break;
+            case LOGREC_INTMAX:
+                i = va_arg(args, intmax_t);
+                rv = put(buf, &len, size, &i, sizeof(i));
+                break;
+            case LOGREC_UINTMAX:
+                u = va_arg(args, uintmax_t);
+                rv = put(buf, &len, size, &u, sizeof(u));
+                break;
+            case LOGREC_PTRDIFF:
+                i = va_arg(args, ptrdiff_t);
+                rv = put(buf, &len, size, &i, sizeof(i));
+                break;
+            case LOGREC_DOUBLE:
+                d = va_arg(args, double);
+                rv = put(buf, &len, size, &d, sizeof(d));
+                break;
+            case LOGREC_LDOUBLE:
+                ld = va_arg(args, long double);
+                rv = put(buf, &len, size, &ld, sizeof(ld));
+                break;
+            case LOGREC_PTR:
+                u = (uintptr_t) va_arg(args, void*);
+                rv = put(buf, &len, size, &u, sizeof(u));
+                break;
+            case LOGREC_STR:
+                s = va_arg(args, const char*);
+                if(size - len < sizeof(slen))
+                {
+                    rv = -1;
+                    break;
+                }
+                slen = STR_NULL;
+                if(NULL != s)
+                {
+                    n = strnlen(s, size - len - sizeof(slen));
+                    slen = (STR_NULL <= n) ? STR_NULL - 1 : n;
+                }
+                put(buf, &len, size, &slen, sizeof(slen));
+                if(STR_NULL != slen)
+                    put(buf, &len, size, s, slen);
+                break;
+        }
+    }
+    return len;
+}
+
+static int
+get(const char* args, size_t* pos, size_t len, void* data, size_t n)
+{
+    if(len - *pos < n)
+        return -1;
+    memcpy(data, args + *pos, n);
+    *pos += n;
+    return 0;
+}
+
+/**
+ * Copies the conversion with its '*' replaced by the numbers from
+ * args. A negative precision counts as none.
+ */
+static int
+fill_stars(const struct spec* sp, const char* args, size_t* pos,
+        size_t len, char* fmt)
+{
+    size_t i;
+    size_t n = 0;
+    int64_t star;
+
+    for(i = 0; i < sp->sp_len; ++i)
+    {
+        if('*' != sp->sp_start[i])
+        {
+            fmt[n++] = sp->sp_start[i];
+            continue;
+        }
+        if(-1 == get(args, pos, len, &star, sizeof(star)))
+            return -1;
+        if('.' == sp->sp_start[i - 1] && 0 > star)
+            --n;
+        else
+            n += sprintf(fmt + n, "%d", (int) star);
+    }
+    fmt[n] = '\0';
+    return 0;
+}
+
+/**
+ * Prints a packed string, which has no '\0', bounding it by the
+ * precision.
+ */
+static int
+render_str(char* fmt, const char* s, int slen, char* out, size_t size)
+{
+    char* dot = strchr(fmt, '.');
+
+    if(NULL != dot)
+    {
+        if(atoi(dot + 1) < slen)
+            slen = atoi(dot + 1);
+    }
+    else
+    {
+        dot = fmt + strlen(fmt) - 1;
+    }
+    strcpy(dot, ".*s");
+    return snprintf(out, size, fmt, slen, s);
+}
+
+static int
+render_one(const struct spec* sp, char* fmt, const char* args,
+        size_t* pos, size_t len, char* out, size_t size)
+{
+    int64_t i;
+    uint64_t u;
+    double d;
+    long double ld;
+    uint16_t slen;
+
+    switch(sp->sp_kind)
+    {
+        case LOGREC_INT:
+            if(-1 == get(args, pos, len, &i, sizeof(i)))
+                return -1;
+            return snprintf(out, size, fmt, (int) i);
+        case LOGREC_UINT:
+            if(-1 == get(args, pos, len, &u, sizeof(u)))
+                return -1;
+            return snprintf(out, size, fmt, (unsigned int) u);
+        case LOGREC_LONG:
+            if(-1 == get(args, pos, len, &i, sizeof(i)))
+                return -1;
+            return snprintf(out, size, fmt, (long) i);
+        case LOGREC_ULONG:
+            if(-1 == get(args, pos, len, &u, sizeof(u)))
+                return -1;
+            return snprintf(out, size, fmt, (unsigned long) u);
+        case LOGREC_LLONG:
+            if(-1 == get(args, pos, len, &i, sizeof(i)))
+                return -1;
+            return snprintf(out, size, fmt, (long long) i);
+        case LOGREC_ULLONG:
+            if(-1 == get(args, pos, len, &u, sizeof(u)))
+                return -1;
+            return snprintf(out, size, fmt, (unsigned long long) u);
+        case LOGREC_SIZE:
+            if(-1 == get(args, pos, len, &u, sizeof(u)))
+                return -1;
+            return snprintf(out, size, fmt, (size_t) u);
+        case LOGREC_INTMAX:
+            if(-1 == get(args, pos, len, &i, sizeof(i)))
+                return -1;
+            return snprintf(out, size, fmt, (intmax_t) i);
+        case LOGREC_UINTMAX:
+            if(-1 == get(args, pos, len, &u, sizeof(u)))
+                return -1;
+            return snprintf(out, size, fmt, (uintmax_t) u);
+        case LOGREC_PTRDIFF:
+            if(-1 == get(args, pos, len, &i, sizeof(i)))
+                return -1;
+            return snprintf(out, size, fmt, (ptrdiff_t) i);
+        case LOGREC_DOUBLE:
+            if(-1 == get(args, pos, len, &d, sizeof(d)))
+                return -1;
+            return snprintf(out, size, fmt, d);
+        case LOGREC_LDOUBLE:
+            if(-1 == get(args, pos, len, &ld, sizeof(ld)))
+                return -1;
+            return snprintf(out, size, fmt, ld);
+        case LOGREC_PTR:
+            if(-1 == get(args, pos, len, &u, sizeof(u)))
+                return -1;
+            return snprintf(out, size, fmt, (void*) (uintptr_t) u);
+        case LOGREC_STR:
+            if(-1 == get(args, pos, len, &slen, sizeof(slen)))
+                return -1;
+            if(STR_NULL == slen)
+                return snprintf(out, size, fmt, (const char*) NULL);
+            if(len - *pos < slen)
+                return -1;
+            *pos += slen;
+            return render_str(fmt, args + *pos - slen, slen, out, size);
+        default:
+            return snprintf(out, size, "%%");
+    }
+}
+
+int
+logrec_render(const char* format, const char* args, size_t len,
+        char* out, size_t size)
+{
+    struct spec sp;
+    char fmt[SPEC_SIZE * 2];
+    size_t pos = 0;
+    size_t n = 0;
+    size_t lit;
+    int rv;
+
+    while('\0' != *format && n + 1 < size)
+    {
+        lit = strcspn(format, "%");
+        if(0 == lit && -1 == read_spec(format, &sp))
+            lit = 1; // printed as it is
+        if(0 < lit)
+        {
+            rv = snprintf(out + n, size - n, "%.*s", (int) lit, format);
+            format += lit;
+        }
+        else
+        {
+            format += sp.sp_len;
+            rv = -1;
+            if(0 == fill_stars(&sp, args, &pos, len, fmt))
+            {
+                rv = render_one(&sp, fmt, args, &pos, len,
+                        out + n, size - n);
+            }
+            if(0 > rv)
+                rv = snprintf(out + n, size - n, "<?>");
+        }
+        if(size - n <= (size_t) rv)
+            return size;
+        n += rv;
+    }
+    if(0 < size)
+        out[n] = '\0';
+    return ('\0' != *format) ? (int) size : (int) n;
+}
@@ -0,0 +1,83 @@
+#ifndef LOGREC_H
+#define LOGREC_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOGREC_MAGIC 0x4c4f4752 // "LOGR", tells the byte order too
+#define LOGREC_VERSION 1
+#define LOGREC_ARGS_MAX 8 // a format with more is logged as text
+
+/*
+ * The binary log is a stream of records, each a header followed by
+ * r_len bytes. It starts with LOGREC_START carrying LOGREC_MAGIC in
+ * r_id and the version in r_time. A LOGREC_FORMAT record defines the
+ * format string of id r_id before the first LOGREC_ARGS record using
+ * it. The arguments of LOGREC_ARGS are packed by logrec_pack().
+ */
+enum logrec_type
+{
+    LOGREC_START,
+    LOGREC_FORMAT,
+    LOGREC_ARGS,
+    LOGREC_TEXT
+};
+
+struct logrec
+{
+    uint16_t r_len;
+    uint8_t r_type;
+    uint8_t r_pad;
+    uint32_t r_id;
+    uint64_t r_time; // nanoseconds since the epoch
+};
+
+/**
+ * What has to be taken from va_list for a conversion, in the order of
+ * the format. A '*' width or precision is a LOGREC_INT of its own.
+ */
+enum logrec_kind
+{
+    LOGREC_INT,
+    LOGREC_UINT,
+    LOGREC_LONG,
+    LOGREC_ULONG,
+    LOGREC_LLONG,
+    LOGREC_ULLONG,
+    LOGREC_SIZE,
+    LOGREC_INTMAX,
+    LOGREC_UINTMAX,
+    LOGREC_PTRDIFF,
+    LOGREC_DOUBLE,
+    LOGREC_LDOUBLE,
+    LOGREC_STR,
+    LOGREC_PTR
+};
+
+/**
+ * Fills kinds with what the format takes. Returns their number or -1
+ * if the format can only be logged as text: it takes more than
+ * LOGREC_ARGS_MAX arguments or has a conversion like %n or %m.
+ */
+int
+logrec_parse(const char* format, unsigned char* kinds);
+
+/**
+ * Packs the arguments into buf. Integers, pointers and doubles take
+ * 8 bytes, strings their length in 2 bytes and the bytes, cut to fit.
+ * Returns the number of bytes used.
+ */
+size_t
+logrec_pack(const unsigned char* kinds, int nkinds, va_list args,
+        char* buf, size_t size);
+
+/**
+ * Prints the format with the packed arguments into out like snprintf.
+ * Missing arguments are shown as "<?>".
+ */
+int
+logrec_render(const char* format, const char* args, size_t len,
+        char* out, size_t size);
+
+#endif
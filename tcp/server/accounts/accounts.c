@@ -0,0 +1,304 @@
+#include "logger/logger.h"
+#include "server/accounts/accounts.h"
+#include "server/epoch/epoch.h"
+#include "server/handler/peer/peer.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_ACCOUNTS
+#define ACCOUNTS_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+struct account
+{
+    char a_login[ACCOUNTS_LOGIN_SIZE];
+    char a_pass[ACCOUNTS_PASS_SIZE];
+    char a_mode;
+};
+
+/*
+ * An open-addressed table keyed by login, allocated as one block so
+ * that epoch_retire() can free it as a whole. It is never changed once
+ * published, a reload builds a new one and swaps the pointer.
+ */
+struct table
+{
+    size_t t_mask;
+    struct account t_slots[];
+};
+
+static struct table* g_table;
+static char* g_path;
+static const char* g_name;
+static int g_inotify = -1;
+static int g_evfd = -1;
+static pthread_t g_tid;
+static int g_iswatching;
+
+static size_t
+hash(const char* s)
+{
+    size_t h = 2166136261u;
+
+    while('\0' != *s)
+    {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct account*
+find(struct table* t, const char* login)
+{
+    size_t i = hash(login) & t->t_mask;
+
+    while('\0' != t->t_slots[i].a_login[0])
+    {
+        if(0 == strcmp(login, t->t_slots[i].a_login))
+            return &t->t_slots[i];
+        i = (i + 1) & t->t_mask;
+    }
+    return &t->t_slots[i];
+}
+
+static struct account*
+read_all(FILE* db, size_t* len)
+{
+    size_t cap = 16;
+    struct account a;
+    struct account* tmp;
+    struct account* all = malloc(cap * sizeof(struct account));
+
+    *len = 0;
+    while(NULL != all && 3 == fscanf(db, " %10[a-zA-Z] %10[^;\t\r\n ] %hhd",
+                a.a_login, a.a_pass, &a.a_mode))
+    {
+        if(*len == cap)
+        {
+            cap *= 2;
+            tmp = realloc(all, cap * sizeof(struct account));
+            if(NULL == tmp)
+                free(all);
+            all = tmp;
+            if(NULL == all)
+                break;
+        }
+        all[(*len)++] = a;
+    }
+    return all;
+}
+
+/**
+ * Reads the whole file into a new table; the file keeps the format
+ * the service used to scan on every login.
+ */
+static struct table*
+load(const char* path)
+{
+    size_t len;
+    size_t size = 16;
+    struct account* all;
+    struct table* t = NULL;
+    FILE* db = fopen(path, "r");
+
+    if(NULL == db)
+    {
+        logger_error("[accounts] %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    all = read_all(db, &len);
+    fclose(db);
+    if(NULL == all)
+    {
+        logger_error("[accounts] malloc failed\n");
+        return NULL;
+    }
+
+    while(size < 2 * len)
+        size *= 2;
+    t = calloc(1, sizeof(struct table) + size * sizeof(struct account));
+    if(NULL != t)
+    {
+        t->t_mask = size - 1;
+        // the first line of a login wins, as with the scan before
+        while(0 < len)
+        {
+            --len;
+            *find(t, all[len].a_login) = all[len];
+        }
+    }
+    free(all);
+    return t;
+}
+
+static void
+publish(struct table* t)
+{
+    struct table* old;
+
+    do
+    {
+        old = __sync_or_and_fetch(&g_table, 0);
+    } while(!__sync_bool_compare_and_swap(&g_table, old, t));
+    epoch_retire(old);
+}
+
+/**
+ * Loads the file again and swaps the table in. Logins in progress keep
+ * using the old one, which is freed after they are done.
+ * A failed load keeps the current table.
+ */
+int
+accounts_reload()
+{
+    struct table* t = load(g_path);
+
+    if(NULL == t)
+        return -1;
+    publish(t);
+    logger_info("[accounts] loaded %s\n", g_path);
+    return 0;
+}
+
+/**
+ * Returns the mode of the account or PEER_NO_PERMS,
+ * -1 if nothing has been loaded.
+ */
+int
+accounts_check(const char* login, const char* pass)
+{
+    int mode = -1;
+    unsigned int e = epoch_enter();
+    struct table* t = __sync_or_and_fetch(&g_table, 0);
+
+    if(NULL != t)
+    {
+        struct account* a = find(t, login);
+        mode = PEER_NO_PERMS;
+        if('\0' != a->a_login[0] && 0 == strcmp(pass, a->a_pass))
+            mode = a->a_mode;
+    }
+    epoch_exit(e);
+    return mode;
+}
+
+/**
+ * The directory is watched rather than the file, so a file replaced
+ * by rename() is noticed too.
+ */
+static void*
+accounts_watch(void* arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2];
+    ssize_t n;
+    ssize_t i;
+    int isdirty;
+    (void) arg;
+
+    fds[0].fd = g_inotify;
+    fds[0].events = POLLIN;
+    fds[1].fd = g_evfd;
+    fds[1].events = POLLIN;
+
+    while(1)
+    {
+        if(-1 == poll(fds, 2, -1))
+        {
+            if(EINTR == errno)
+                continue;
+            logger_error("[accounts] poll: %s\n", strerror(errno));
+            break;
+        }
+        if(fds[1].revents)
+            break;
+
+        isdirty = 0;
+        n = read(g_inotify, buf, sizeof(buf));
+        for(i = 0; i < n; )
+        {
+            struct inotify_event* ev = (struct inotify_event*) (buf + i);
+            if(0 < ev->len && 0 == strcmp(ev->name, g_name))
+                isdirty = 1;
+            i += sizeof(struct inotify_event) + ev->len;
+        }
+        if(isdirty)
+            accounts_reload();
+    }
+    return NULL;
+}
+
+int
+accounts_init(const char* path)
+{
+    char* dir;
+    char* slash;
+
+    g_path = strdup(path);
+    dir = strdup(path);
+    if(NULL == g_path || NULL == dir)
+    {
+        free(dir);
+        logger_error("[accounts] malloc failed\n");
+        return -1;
+    }
+    slash = strrchr(dir, '/');
+    g_name = (NULL == slash) ? g_path : g_path + (slash - dir) + 1;
+    if(NULL == slash)
+        strcpy(dir, ".");
+    else if(slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    // a missing file is not fatal, logins fail until it appears
+    accounts_reload();
+
+    // neither is a failed watch, the accounts just stay as loaded
+    g_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    g_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(-1 == g_inotify || -1 == g_evfd
+            || -1 == inotify_add_watch(g_inotify, dir, ACCOUNTS_EVENTS)
+            || 0 != pthread_create(&g_tid, NULL, accounts_watch, NULL))
+        logger_error("[accounts] cannot watch %s: %s\n", dir, strerror(errno));
+    else
+        g_iswatching = 1;
+    free(dir);
+    return 0;
+}
+
+void
+accounts_destroy()
+{
+    uint64_t one = 1;
+
+    if(g_iswatching)
+    {
+        if(-1 == write(g_evfd, &one, sizeof(one)))
+            logger_error("[accounts] write: %s\n", strerror(errno));
+        pthread_join(g_tid, NULL);
+        g_iswatching = 0;
+    }
+    if(-1 != g_evfd)
+    {
+        close(g_evfd);
+        g_evfd = -1;
+    }
+    if(-1 != g_inotify)
+    {
+        close(g_inotify);
+        g_inotify = -1;
+    }
+    publish(NULL);
+    free(g_path);
+    g_path = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef ACCOUNTS_H
+#define ACCOUNTS_H
+
+#define ACCOUNTS_PATH "/tmp/accounts"
+#define ACCOUNTS_LOGIN_SIZE 11
+#define ACCOUNTS_PASS_SIZE 11
+
+int
+accounts_init(const char* path);
+
+void
+accounts_destroy();
+
+int
+accounts_check(const char* login, const char* pass);
+
+int
+accounts_reload();
+
+#endif
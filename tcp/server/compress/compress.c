@@ -0,0 +1,89 @@
+#include "lib/iobuf.h"
+#include "logger/logger.h"
+#include "server/compress/compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_COMPRESS
+
+/*
+ * The deflate stream of a session. It keeps its window between bodies,
+ * so a listing similar to an earlier one costs a few back references.
+ */
+struct compress
+{
+    z_stream c_zs;
+    struct iobuf c_out;
+};
+
+struct compress*
+compress_new()
+{
+    struct compress* c = malloc(sizeof(struct compress));
+
+    if(NULL == c)
+        return NULL;
+    memset(&c->c_zs, 0, sizeof(z_stream));
+    if(Z_OK != deflateInit(&c->c_zs, COMPRESS_LEVEL))
+    {
+        logger_error("[compress] deflateInit failed\n");
+        free(c);
+        return NULL;
+    }
+    if(-1 == iobuf_init(&c->c_out, COMPRESS_STEP))
+    {
+        deflateEnd(&c->c_zs);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void
+compress_free(struct compress* c)
+{
+    if(NULL == c)
+        return;
+    deflateEnd(&c->c_zs);
+    iobuf_free(&c->c_out);
+    free(c);
+}
+
+/**
+ * Deflates the segments as the next part of the stream and flushes it,
+ * so that the part can be inflated on its own. out points into c and
+ * stays valid until the next call. Returns -1 if out of memory, then
+ * the stream is broken and c has to be freed.
+ */
+int
+compress_iov(struct compress* c, const struct iovec* iov, int iovcnt,
+        struct iovec* out)
+{
+    int i;
+    int flush;
+    struct iobuf* b = &c->c_out;
+    z_stream* zs = &c->c_zs;
+
+    iobuf_consume(b, iobuf_size(b));
+    for(i = 0; i < iovcnt; ++i)
+    {
+        zs->next_in = (Bytef*) iov[i].iov_base;
+        zs->avail_in = iov[i].iov_len;
+        flush = (i == iovcnt - 1) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        do
+        {
+            if(-1 == iobuf_reserve(b, COMPRESS_STEP))
+                return -1;
+            zs->next_out = (Bytef*) b->b_data + b->b_len;
+            zs->avail_out = b->b_cap - b->b_len;
+            deflate(zs, flush);
+            b->b_len = b->b_cap - zs->avail_out;
+        } while(0 == zs->avail_out);
+    }
+
+    out->iov_base = b->b_data + b->b_off;
+    out->iov_len = iobuf_size(b);
+    return 0;
+}
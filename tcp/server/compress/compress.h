@@ -0,0 +1,22 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/uio.h>
+
+#define COMPRESS_MIN 512 // shorter bodies are sent as they are
+#define COMPRESS_LEVEL 6
+#define COMPRESS_STEP 4096
+
+struct compress;
+
+struct compress*
+compress_new();
+
+void
+compress_free(struct compress* c);
+
+int
+compress_iov(struct compress* c, const struct iovec* iov, int iovcnt,
+        struct iovec* out);
+
+#endif
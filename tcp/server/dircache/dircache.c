@@ -0,0 +1,772 @@
+#include "logger/logger.h"
+#include "server/dircache/dircache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_DIRCACHE
+#define WATCH_MASK (IN_ATTRIB | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM \
+        | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+#define EVENTS_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/*
+ * An inotify watch on a directory some paths go through. Its generation
+ * moves when the directory, or a subdirectory, is renamed, removed,
+ * replaced or gets other permissions. A directory removed while it is
+ * open gets no event of its own, so the one of the parent counts.
+ */
+struct watch
+{
+    struct watch* w_nextwd; // in the bucket by wd
+    struct watch* w_nextpath; // in the bucket by path
+    int w_wd; // -1 once the kernel has dropped it
+    int w_refs; // the entries going through it
+    unsigned long w_gen;
+    char* w_path; // NULL once it may lead elsewhere
+};
+
+struct dep
+{
+    struct watch* dp_watch;
+    unsigned long dp_gen;
+};
+
+/*
+ * Where e_key leads from the directory (e_startdev, e_startino). It is
+ * right while every directory on the way has its generation.
+ */
+struct entry
+{
+    struct entry* e_next; // in the bucket
+    struct entry* e_newer;
+    struct entry* e_older;
+    dev_t e_startdev;
+    ino_t e_startino;
+    char* e_key;
+    struct dircache_dir e_dir; // no descriptor, d_fd is -1
+    size_t e_depslen;
+    struct dep e_deps[];
+};
+
+struct cache
+{
+    pthread_mutex_t c_mx;
+    int c_ifd; // -1 if nothing is kept
+    int c_evfd; // wakes the watcher up to leave
+    pthread_t c_tid;
+    struct entry* c_buckets[DIRCACHE_BUCKETS];
+    struct watch* c_bywd[DIRCACHE_BUCKETS];
+    struct watch* c_bypath[DIRCACHE_BUCKETS];
+    struct entry* c_newest;
+    struct entry* c_oldest;
+    size_t c_len;
+    size_t c_max;
+    size_t c_watches;
+
+    unsigned long c_hits;
+    unsigned long c_misses;
+    unsigned long c_stale;
+    unsigned long c_evicted;
+    unsigned long c_changes;
+};
+
+static struct cache g_cache;
+
+static size_t
+hash(const char* s, size_t h)
+{
+    while('\0' != *s)
+        h = (h ^ (unsigned char) *s++) * 0x100000001b3ULL;
+    return h;
+}
+
+static size_t
+bucket(dev_t dev, ino_t ino, const char* path)
+{
+    return hash(path, (size_t) ((ino * 0x9e3779b97f4a7c15ULL) ^ dev))
+        % DIRCACHE_BUCKETS;
+}
+
+/* the following work under c_mx */
+
+static struct watch**
+watch_bywd(struct cache* c, int wd)
+{
+    struct watch** pw = &c->c_bywd[(unsigned int) wd % DIRCACHE_BUCKETS];
+
+    while(NULL != *pw && (*pw)->w_wd != wd)
+        pw = &(*pw)->w_nextwd;
+    return pw;
+}
+
+static struct watch**
+watch_bypath(struct cache* c, const char* path)
+{
+    struct watch** pw = &c->c_bypath[hash(path, 0) % DIRCACHE_BUCKETS];
+
+    while(NULL != *pw && 0 != strcmp((*pw)->w_path, path))
+        pw = &(*pw)->w_nextpath;
+    return pw;
+}
+
+static void
+watch_unpath(struct cache* c, struct watch* w)
+{
+    struct watch** pw;
+
+    if(NULL == w->w_path)
+        return;
+    pw = &c->c_bypath[hash(w->w_path, 0) % DIRCACHE_BUCKETS];
+    while(*pw != w)
+        pw = &(*pw)->w_nextpath;
+    *pw = w->w_nextpath;
+    free(w->w_path);
+    w->w_path = NULL;
+}
+
+static void
+watch_unwd(struct cache* c, struct watch* w)
+{
+    struct watch** pw;
+
+    if(-1 == w->w_wd)
+        return;
+    pw = watch_bywd(c, w->w_wd);
+    *pw = w->w_nextwd;
+    w->w_wd = -1;
+}
+
+/**
+ * Takes the watch already on the path, if any, and its generation.
+ */
+static void
+watch_hold(struct cache* c, const char* path, struct dep* dp)
+{
+    struct watch* w = *watch_bypath(c, path);
+
+    dp->dp_watch = NULL;
+    if(NULL == w || -1 == w->w_wd)
+        return;
+    ++w->w_refs;
+    dp->dp_watch = w;
+    dp->dp_gen = w->w_gen;
+}
+
+/**
+ * Takes the watch for the wd the kernel gave the path. A directory
+ * already watched under another path has the same wd and keeps it.
+ */
+static struct watch*
+watch_attach(struct cache* c, const char* path, int wd)
+{
+    struct watch** pw = watch_bywd(c, wd);
+    struct watch* w = *pw;
+
+    if(NULL == w)
+    {
+        w = calloc(1, sizeof(struct watch));
+        if(NULL == w)
+        {
+            inotify_rm_watch(c->c_ifd, wd);
+            return NULL;
+        }
+        w->w_wd = wd;
+        *pw = w;
+        ++c->c_watches;
+    }
+    if(NULL == w->w_path && NULL == *watch_bypath(c, path)
+            && NULL != (w->w_path = strdup(path)))
+    {
+        pw = &c->c_bypath[hash(path, 0) % DIRCACHE_BUCKETS];
+        w->w_nextpath = *pw;
+        *pw = w;
+    }
+    ++w->w_refs;
+    return w;
+}
+
+static void
+watch_put(struct cache* c, struct watch* w)
+{
+    if(0 != --w->w_refs)
+        return;
+    if(-1 != w->w_wd)
+    {
+        inotify_rm_watch(c->c_ifd, w->w_wd);
+        watch_unwd(c, w);
+    }
+    watch_unpath(c, w);
+    --c->c_watches;
+    free(w);
+}
+
+/**
+ * Moves every watch at the path or beneath it. If the path is gone,
+ * their paths are forgotten as well.
+ */
+static void
+watch_change(struct cache* c, const char* path, int isgone)
+{
+    int i;
+    struct watch* w;
+    struct watch* next;
+    size_t len = strlen(path);
+
+    for(i = 0; i < DIRCACHE_BUCKETS; ++i)
+    {
+        for(w = c->c_bywd[i]; NULL != w; w = next)
+        {
+            next = w->w_nextwd;
+            if(NULL == w->w_path || 0 != strncmp(w->w_path, path, len)
+                    || ('\0' != w->w_path[len] && '/' != w->w_path[len]
+                        && 1 < len))
+                continue;
+            ++w->w_gen;
+            if(isgone)
+                watch_unpath(c, w);
+        }
+    }
+}
+
+static void
+apply(struct cache* c, const struct inotify_event* ev)
+{
+    char path[PATH_MAX];
+    struct watch* w;
+
+    ++c->c_changes;
+    if(ev->mask & IN_Q_OVERFLOW)
+    {
+        // events were lost, nothing can be trusted
+        watch_change(c, "/", 1);
+        return;
+    }
+
+    w = *watch_bywd(c, ev->wd);
+    if(NULL == w)
+        return;
+    if(0 < ev->len)
+    {
+        // only subdirectories matter, no entry leads through a file
+        if(!(ev->mask & IN_ISDIR) || NULL == w->w_path
+                || (int) sizeof(path) <= snprintf(path, sizeof(path), "%s/%s",
+                    ('\0' == w->w_path[1]) ? "" : w->w_path, ev->name))
+            return;
+        watch_change(c, path, !(ev->mask & IN_ATTRIB));
+    }
+    else if(ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+    {
+        ++w->w_gen;
+        if(NULL != w->w_path)
+            watch_change(c, w->w_path, 1);
+        if(ev->mask & IN_IGNORED)
+            watch_unwd(c, w);
+    }
+    else
+    {
+        ++w->w_gen;
+    }
+}
+
+static void
+lru_unlink(struct cache* c, struct entry* e)
+{
+    if(NULL != e->e_newer)
+        e->e_newer->e_older = e->e_older;
+    else
+        c->c_newest = e->e_older;
+    if(NULL != e->e_older)
+        e->e_older->e_newer = e->e_newer;
+    else
+        c->c_oldest = e->e_newer;
+}
+
+static void
+lru_push(struct cache* c, struct entry* e)
+{
+    e->e_newer = NULL;
+    e->e_older = c->c_newest;
+    if(NULL != c->c_newest)
+        c->c_newest->e_newer = e;
+    c->c_newest = e;
+    if(NULL == c->c_oldest)
+        c->c_oldest = e;
+}
+
+static struct entry**
+lookup(struct cache* c, dev_t dev, ino_t ino, const char* path)
+{
+    struct entry** pe = &c->c_buckets[bucket(dev, ino, path)];
+
+    while(NULL != *pe && ((*pe)->e_startdev != dev
+                || (*pe)->e_startino != ino || 0 != strcmp((*pe)->e_key, path)))
+        pe = &(*pe)->e_next;
+    return pe;
+}
+
+static int
+isvalid(const struct entry* e)
+{
+    size_t i;
+
+    for(i = 0; i < e->e_depslen; ++i)
+    {
+        if(e->e_deps[i].dp_watch->w_gen != e->e_deps[i].dp_gen)
+            return 0;
+    }
+    return 1;
+}
+
+static void
+entry_free(struct cache* c, struct entry* e)
+{
+    size_t i;
+
+    for(i = 0; i < e->e_depslen; ++i)
+    {
+        watch_put(c, e->e_deps[i].dp_watch);
+    }
+    free(e->e_dir.d_path);
+    free(e->e_key);
+    free(e);
+}
+
+static void
+unlink_entry(struct cache* c, struct entry** pe)
+{
+    struct entry* e = *pe;
+
+    *pe = e->e_next;
+    lru_unlink(c, e);
+    --c->c_len;
+    entry_free(c, e);
+}
+
+static void
+insert(struct cache* c, struct entry* e)
+{
+    struct entry** pe = lookup(c, e->e_startdev, e->e_startino, e->e_key);
+
+    if(NULL != *pe)
+        unlink_entry(c, pe);
+    pe = &c->c_buckets[bucket(e->e_startdev, e->e_startino, e->e_key)];
+    e->e_next = *pe;
+    *pe = e;
+    lru_push(c, e);
+    ++c->c_len;
+
+    while(c->c_len > c->c_max)
+    {
+        struct entry* old = c->c_oldest;
+        unlink_entry(c, lookup(c, old->e_startdev, old->e_startino,
+                    old->e_key));
+        ++c->c_evicted;
+    }
+}
+
+/* end of c_mx */
+
+/**
+ * Keeps a copy of a directory the path goes through.
+ */
+static int
+depend(const char* path, char** paths, size_t* len)
+{
+    if(DIRCACHE_DEPTH_MAX == *len || NULL == (paths[*len] = strdup(path)))
+        return -1;
+    ++*len;
+    return 0;
+}
+
+/**
+ * Walks the path by its names as the kernel does when there are no
+ * symlinks, collecting every directory on the way and those above them.
+ * Leaves the path it ends at in buf.
+ */
+static int
+walk(char* buf, const char* start, const char* root, const char* path,
+        char** paths, size_t* npaths)
+{
+    size_t i;
+    size_t n;
+    size_t len;
+    size_t rootlen = strlen(root);
+    const char* s;
+    const char* end;
+    const char* base = ('/' == path[0]) ? root : start;
+
+    len = strlen(base);
+    if(PATH_MAX <= len || '/' != base[0])
+        return -1;
+    memcpy(buf, "/", 2);
+    if(-1 == depend(buf, paths, npaths))
+        return -1;
+    memcpy(buf, base, len + 1);
+    for(i = 2; i <= len; ++i)
+    {
+        if(i == len || '/' == buf[i])
+        {
+            buf[i] = '\0';
+            if(-1 == depend(buf, paths, npaths))
+                return -1;
+            buf[i] = base[i];
+        }
+    }
+
+    for(s = path; '\0' != *s; s = ('\0' == *end) ? end : end + 1)
+    {
+        end = strchrnul(s, '/');
+        n = end - s;
+        if(0 == n || (1 == n && '.' == s[0]))
+            continue;
+        if(2 == n && '.' == s[0] && '.' == s[1])
+        {
+            if(len > rootlen)
+            {
+                while('/' != buf[len - 1])
+                    --len;
+                len = (1 < len) ? len - 1 : 1;
+                buf[len] = '\0';
+            }
+            continue;
+        }
+        if(PATH_MAX <= len + n + 1)
+            return -1;
+        if(1 < len)
+            buf[len++] = '/';
+        memcpy(buf + len, s, n);
+        len += n;
+        buf[len] = '\0';
+        if(-1 == depend(buf, paths, npaths))
+            return -1;
+    }
+    return 0;
+}
+
+static void*
+watch_events(void* arg)
+{
+    struct cache* c = (struct cache*) arg;
+    char buf[EVENTS_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* ev;
+    struct pollfd fds[2] = {{c->c_ifd, POLLIN, 0}, {c->c_evfd, POLLIN, 0}};
+    ssize_t n;
+    ssize_t off;
+
+    for(;;)
+    {
+        if(-1 == poll(fds, 2, -1))
+        {
+            if(EINTR == errno)
+                continue;
+            logger_error("[dircache] poll: %s\n", strerror(errno));
+            break;
+        }
+        if(0 != fds[1].revents)
+            break; // woken up by dircache_destroy()
+
+        n = read(c->c_ifd, buf, sizeof(buf));
+        if(0 >= n)
+            continue;
+        pthread_mutex_lock(&c->c_mx);
+        for(off = 0; off < n; off += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event*) (buf + off);
+            apply(c, ev);
+        }
+        pthread_mutex_unlock(&c->c_mx);
+    }
+    return NULL;
+}
+
+int
+dircache_init(size_t size)
+{
+    struct cache* c = &g_cache;
+
+    memset(c, 0, sizeof(struct cache));
+    c->c_max = size;
+    c->c_ifd = -1;
+    c->c_evfd = -1;
+    pthread_mutex_init(&c->c_mx, NULL);
+    if(0 == size)
+        return 0;
+
+    c->c_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(-1 == c->c_ifd)
+    {
+        // CD works the same, only slower
+        logger_error("[dircache] inotify_init1 failed: %s\n", strerror(errno));
+        return 0;
+    }
+    c->c_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(-1 == c->c_evfd
+            || 0 != pthread_create(&c->c_tid, NULL, watch_events, c))
+    {
+        logger_error("[dircache] the watcher failed: %s\n", strerror(errno));
+        if(-1 != c->c_evfd)
+            close(c->c_evfd);
+        close(c->c_ifd);
+        c->c_ifd = -1;
+        c->c_evfd = -1;
+        return -1;
+    }
+    logger_info("[dircache] keeping up to %zu paths\n", size);
+    return 0;
+}
+
+void
+dircache_destroy()
+{
+    struct cache* c = &g_cache;
+    uint64_t one = 1;
+    int i;
+
+    if(-1 != c->c_ifd)
+    {
+        if(-1 == write(c->c_evfd, &one, sizeof(one)))
+            logger_error("[dircache] write: %s\n", strerror(errno));
+        pthread_join(c->c_tid, NULL);
+        close(c->c_evfd);
+    }
+    for(i = 0; i < DIRCACHE_BUCKETS; ++i)
+    {
+        while(NULL != c->c_buckets[i])
+            unlink_entry(c, &c->c_buckets[i]);
+    }
+    if(-1 != c->c_ifd)
+        close(c->c_ifd);
+    c->c_ifd = -1;
+    pthread_mutex_destroy(&c->c_mx);
+}
+
+/**
+ * Entries keep no descriptors, thousands of them would exhaust
+ * RLIMIT_NOFILE. The real path of a hit is opened again instead, and it
+ * must still be the same directory.
+ */
+static int
+reopen(struct dircache_dir* d)
+{
+    struct stat st;
+
+    d->d_fd = open(d->d_path, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(-1 == d->d_fd)
+        return -1;
+    if(-1 == fstat(d->d_fd, &st)
+            || st.st_dev != d->d_dev || st.st_ino != d->d_ino)
+    {
+        close(d->d_fd);
+        d->d_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int
+dircache_find(dev_t dev, ino_t ino, const char* path,
+        struct dircache_dir* d)
+{
+    int rv = -1;
+    int state;
+    struct entry** pe;
+    struct entry* e;
+    struct cache* c = &g_cache;
+
+    if(-1 == c->c_ifd)
+        return -1;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&c->c_mx);
+    pe = lookup(c, dev, ino, path);
+    e = *pe;
+    if(NULL != e && !isvalid(e))
+    {
+        unlink_entry(c, pe);
+        ++c->c_stale;
+        e = NULL;
+    }
+    if(NULL != e && NULL != (d->d_path = strdup(e->e_dir.d_path)))
+    {
+        d->d_dev = e->e_dir.d_dev;
+        d->d_ino = e->e_dir.d_ino;
+        lru_unlink(c, e);
+        lru_push(c, e);
+        ++c->c_hits;
+        rv = 0;
+    }
+    else
+    {
+        ++c->c_misses;
+    }
+    pthread_mutex_unlock(&c->c_mx);
+
+    if(0 == rv && -1 == reopen(d))
+    {
+        free(d->d_path);
+        d->d_path = NULL;
+        rv = -1;
+        pthread_mutex_lock(&c->c_mx);
+        --c->c_hits;
+        ++c->c_misses;
+        ++c->c_stale;
+        pthread_mutex_unlock(&c->c_mx);
+    }
+    pthread_setcancelstate(state, NULL);
+    return rv;
+}
+
+/**
+ * The path is walked and the new watches are set without c_mx, it is
+ * taken only to hold the watches there are and to insert. The entry is
+ * dropped if anything changed meanwhile: a generation of a held watch
+ * moved or, as an event for a new watch may come before the watch is
+ * known, any event was seen at all.
+ */
+void
+dircache_add(dev_t dev, ino_t ino, const char* start, const char* root,
+        const char* path, struct dircache_dir* d)
+{
+    char buf[PATH_MAX];
+    char real[PATH_MAX];
+    char link[32];
+    char* paths[DIRCACHE_DEPTH_MAX];
+    int wds[DIRCACHE_DEPTH_MAX];
+    struct dep deps[DIRCACHE_DEPTH_MAX];
+    size_t n = 0;
+    size_t nheld;
+    size_t i;
+    ssize_t len;
+    int state;
+    int isok;
+    unsigned long changes;
+    struct entry* e = NULL;
+    struct cache* c = &g_cache;
+
+    if(-1 == c->c_ifd)
+        return;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    isok = (0 == walk(buf, start, root, path, paths, &n));
+    if(isok)
+    {
+        pthread_mutex_lock(&c->c_mx);
+        changes = c->c_changes;
+        for(i = 0; i < n; ++i)
+        {
+            watch_hold(c, paths[i], &deps[i]);
+        }
+        pthread_mutex_unlock(&c->c_mx);
+
+        for(i = 0; i < n; ++i)
+        {
+            wds[i] = -1;
+            if(isok && NULL == deps[i].dp_watch && -1 == (wds[i] =
+                        inotify_add_watch(c->c_ifd, paths[i], WATCH_MASK)))
+                isok = 0;
+        }
+        if(isok)
+        {
+            // a rename before the watches were set shows in the real path
+            sprintf(link, "/proc/self/fd/%d", d->d_fd);
+            len = readlink(link, real, sizeof(real) - 1);
+            isok = (0 < len);
+            if(isok)
+            {
+                real[len] = '\0';
+                isok = (0 == strcmp(buf, real) && (NULL == d->d_path
+                            || 0 == strcmp(buf, d->d_path)));
+                if(NULL == d->d_path)
+                    d->d_path = strdup(real);
+            }
+        }
+        if(isok)
+            e = malloc(sizeof(struct entry) + n * sizeof(struct dep));
+        if(NULL != e)
+        {
+            e->e_startdev = dev;
+            e->e_startino = ino;
+            e->e_key = strdup(path);
+            e->e_dir = *d;
+            e->e_dir.d_fd = -1;
+            e->e_dir.d_path = strdup(buf);
+            e->e_depslen = 0;
+            isok = (NULL != e->e_key && NULL != e->e_dir.d_path);
+        }
+
+        pthread_mutex_lock(&c->c_mx);
+        nheld = n;
+        for(i = 0; i < n; ++i)
+        {
+            if(NULL != deps[i].dp_watch)
+            {
+                isok = isok && deps[i].dp_watch->w_gen == deps[i].dp_gen;
+                continue;
+            }
+            // the new ones are taken even if the entry is dropped
+            if(-1 != wds[i])
+                deps[i].dp_watch = watch_attach(c, paths[i], wds[i]);
+            if(NULL == deps[i].dp_watch)
+            {
+                isok = 0;
+                continue;
+            }
+            deps[i].dp_gen = deps[i].dp_watch->w_gen;
+            isok = isok && changes == c->c_changes
+                && *watch_bypath(c, paths[i]) == deps[i].dp_watch;
+        }
+        if(isok && NULL != e)
+        {
+            e->e_depslen = n;
+            memcpy(e->e_deps, deps, n * sizeof(struct dep));
+            nheld = 0; // the entry owns them now
+            insert(c, e);
+            e = NULL;
+        }
+        for(i = 0; i < nheld; ++i)
+        {
+            if(NULL != deps[i].dp_watch)
+                watch_put(c, deps[i].dp_watch);
+        }
+        pthread_mutex_unlock(&c->c_mx);
+    }
+    if(NULL != e)
+        entry_free(c, e); // it has no watches yet
+    for(i = 0; i < n; ++i)
+    {
+        free(paths[i]);
+    }
+    pthread_setcancelstate(state, NULL);
+}
+
+void
+dircache_printinfo()
+{
+    int state;
+    struct cache* c = &g_cache;
+    unsigned long lookups;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&c->c_mx);
+    lookups = c->c_hits + c->c_misses;
+    printf("CD cache: %zu paths, %zu watches\n"
+            "\tHits: %lu of %lu (%lu%%)\n"
+            "\tStale: %lu, evicted: %lu, changes seen: %lu\n",
+            c->c_len, c->c_watches,
+            c->c_hits, lookups, (0 < lookups) ? 100 * c->c_hits / lookups : 0,
+            c->c_stale, c->c_evicted, c->c_changes);
+    pthread_mutex_unlock(&c->c_mx);
+    pthread_setcancelstate(state, NULL);
+}
@@ -0,0 +1,50 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DIRCACHE_SIZE 4096 // paths kept
+#define DIRCACHE_BUCKETS 1024
+#define DIRCACHE_DEPTH_MAX 64 // a deeper path is not kept
+
+/**
+ * A directory found by a path: its own descriptor and real path.
+ */
+struct dircache_dir
+{
+    int d_fd; // O_PATH
+    char* d_path;
+    dev_t d_dev;
+    ino_t d_ino;
+};
+
+int
+dircache_init(size_t size);
+
+void
+dircache_destroy();
+
+/**
+ * Looks up where the path leads from the directory (dev, ino), an
+ * absolute path is looked up from (0, 0). On a hit d gets a new
+ * descriptor and a copy of the path. Returns -1 on a miss.
+ */
+int
+dircache_find(dev_t dev, ino_t ino, const char* path,
+        struct dircache_dir* d);
+
+/**
+ * Remembers where a path without symlinks has led from the directory
+ * (dev, ino) with the real path start; ".." does not climb above root.
+ * It is forgotten once a directory on the way is renamed or removed.
+ * A NULL d->d_path gets the real path the walk is checked against.
+ */
+void
+dircache_add(dev_t dev, ino_t ino, const char* start, const char* root,
+        const char* path, struct dircache_dir* d);
+
+void
+dircache_printinfo();
+
+#endif
@@ -0,0 +1,124 @@
+#include "server/epoch/epoch.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#define EPOCH_BATCH 64
+
+/*
+ * Readers announce themselves in the counter of the current epoch.
+ * A writer unpublishes a pointer and retires it; retired pointers are
+ * freed in batches after the epoch is flipped and every reader which
+ * entered the old epoch has left.
+ * A thread must not retire anything while it is a reader itself.
+ */
+struct epoch
+{
+    unsigned int e_epoch;
+    int e_readers[2];
+
+    pthread_mutex_t e_mx;
+    void** e_retired;
+    size_t e_retiredlen;
+};
+
+static struct epoch g_epoch;
+
+int
+epoch_init()
+{
+    struct epoch* e = &g_epoch;
+
+    e->e_epoch = 0;
+    e->e_readers[0] = 0;
+    e->e_readers[1] = 0;
+    e->e_retiredlen = 0;
+    e->e_retired = malloc(EPOCH_BATCH * sizeof(void*));
+    if(NULL == e->e_retired)
+        return -1;
+    pthread_mutex_init(&e->e_mx, NULL);
+    return 0;
+}
+
+static void
+reclaim(struct epoch* e)
+{
+    unsigned int old = __sync_fetch_and_add(&e->e_epoch, 1);
+
+    while(0 != __sync_fetch_and_or(&e->e_readers[old & 1], 0))
+    {
+        sched_yield();
+    }
+
+    while(0 < e->e_retiredlen)
+    {
+        free(e->e_retired[--e->e_retiredlen]);
+    }
+}
+
+void
+epoch_destroy()
+{
+    struct epoch* e = &g_epoch;
+
+    if(NULL == e->e_retired)
+        return;
+
+    pthread_mutex_lock(&e->e_mx);
+    reclaim(e);
+    pthread_mutex_unlock(&e->e_mx);
+
+    pthread_mutex_destroy(&e->e_mx);
+    free(e->e_retired);
+    e->e_retired = NULL;
+}
+
+unsigned int
+epoch_enter()
+{
+    struct epoch* e = &g_epoch;
+    unsigned int epoch;
+
+    while(1)
+    {
+        epoch = __sync_fetch_and_or(&e->e_epoch, 0);
+        __sync_add_and_fetch(&e->e_readers[epoch & 1], 1);
+        if(epoch == __sync_fetch_and_or(&e->e_epoch, 0))
+            return epoch;
+        // a writer has just flipped the epoch, it may not wait for us
+        __sync_sub_and_fetch(&e->e_readers[epoch & 1], 1);
+    }
+}
+
+void
+epoch_exit(unsigned int epoch)
+{
+    __sync_sub_and_fetch(&g_epoch.e_readers[epoch & 1], 1);
+}
+
+/**
+ * Frees the pointer once no reader can see it.
+ */
+void
+epoch_retire(void* ptr)
+{
+    struct epoch* e = &g_epoch;
+
+    if(NULL == ptr)
+        return;
+
+    pthread_mutex_lock(&e->e_mx);
+    if(NULL == e->e_retired)
+    {
+        // not initialized or already destroyed, nobody reads
+        free(ptr);
+    }
+    else
+    {
+        e->e_retired[e->e_retiredlen++] = ptr;
+        if(EPOCH_BATCH == e->e_retiredlen)
+            reclaim(e);
+    }
+    pthread_mutex_unlock(&e->e_mx);
+}
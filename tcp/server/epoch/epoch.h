@@ -0,0 +1,19 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+int
+epoch_init();
+
+void
+epoch_destroy();
+
+unsigned int
+epoch_enter();
+
+void
+epoch_exit(unsigned int epoch);
+
+void
+epoch_retire(void* ptr);
+
+#endif
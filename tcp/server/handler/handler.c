@@ -1,43 +1,369 @@
 #include "logger/logger.h"
+#include "server/accounts/accounts.h"
+#include "server/dircache/dircache.h"
+#include "server/epoch/epoch.h"
 #include "server/handler/handler.h"
+#include "server/listing/listing.h"
+#include "server/loop/loop.h"
 #include "server/service/service.h"
+#include "server/who/who.h"
 
 #include <errno.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 
-#define HANDLER_PEERS_SIZE 20
+#define LOGGER_CATEGORY LOGGER_CAT_HANDLER
+#define HANDLER_PEERS_MAX 4096
+#define HANDLER_CHUNK_SIZE 128
+#define HANDLER_NO_SLOT ((unsigned int) -1)
+#define HANDLER_PENDING_SIZE 64
+#define HANDLER_PENDING_WAIT 1000 // ms
+
+struct pending
+{
+    int pd_sfd;
+    long pd_deadline; // ms
+    struct sockaddr_storage pd_addr;
+};
 
 static peer_t g_current;
 static peer_t g_total;
 
-static peer_t g_peerslen;
-static struct peer* g_peers;
+/*
+ * Peers live in chunks which are allocated on demand and never move,
+ * so a pointer to a peer stays valid while the server is running.
+ * Free slots are linked through p_next.
+ * g_lock guards the structure of the registry; readers walk the
+ * chunks without it in an epoch section, see handler_foreach().
+ */
+static struct peer** g_chunks;
+static unsigned int g_chunkslen;
+static unsigned int g_capacity;
+static unsigned int g_free;
+
+/*
+ * Connections which wait for a free slot, oldest first.
+ */
+static struct pending* g_pending;
+static unsigned int g_pendinghead;
+static unsigned int g_pendinglen;
+static int g_isclosing;
 
 static pthread_mutex_t g_lock;
 
-void
-handler_init()
+static struct handler_opts g_opts;
+
+/*
+ * What handler_init() sets up, in this order.
+ */
+enum handler_step
+{
+    HANDLER_LOCK, // and the registry
+    HANDLER_EPOCH,
+    HANDLER_ACCOUNTS,
+    HANDLER_LISTING,
+    HANDLER_WHO,
+    HANDLER_DIRCACHE,
+    HANDLER_ROOT,
+    HANDLER_LOOPS
+};
+
+static const char* const g_steps[] = {"calloc", "epoch_init",
+    "accounts_init", "listing_init", "who_init", "dircache_init",
+    "peer_setroot", "loop_init"};
+
+static void*
+handler_service(void* arg);
+
+static struct peer*
+getslot(unsigned int slot)
+{
+    return &g_chunks[slot / HANDLER_CHUNK_SIZE][slot % HANDLER_CHUNK_SIZE];
+}
+
+static int
+grow()
+{
+    unsigned int i;
+    unsigned int base = g_chunkslen * HANDLER_CHUNK_SIZE;
+    struct peer* chunk;
+
+    if(base >= g_capacity)
+        return -1;
+
+    chunk = calloc(HANDLER_CHUNK_SIZE, sizeof(struct peer));
+    if(NULL == chunk)
+    {
+        logger_error("[handler] calloc failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for(i = HANDLER_CHUNK_SIZE; 0 < i--; )
+    {
+        chunk[i].p_slot = base + i;
+        if(base + i < g_capacity)
+        {
+            chunk[i].p_next = g_free;
+            g_free = base + i;
+        }
+    }
+    g_chunks[g_chunkslen] = chunk;
+    __sync_add_and_fetch(&g_chunkslen, 1); // publish the chunk for readers
+    logger_info("[handler] grown to %u slots\n", base + HANDLER_CHUNK_SIZE);
+    return 0;
+}
+
+static struct peer*
+allocpeer()
+{
+    struct peer* p;
+
+    if(HANDLER_NO_SLOT == g_free && -1 == grow())
+        return NULL;
+
+    p = getslot(g_free);
+    g_free = p->p_next;
+    return p;
+}
+
+/**
+ * Bumps the generation of the slot, so those who still keep
+ * the pointer are able to notice that the peer has gone.
+ */
+static void
+freepeer(struct peer* p)
+{
+    unsigned int slot = p->p_slot;
+    unsigned int gen = p->p_gen;
+
+    who_remove(p);
+    peer_destroy(p);
+    p->p_slot = slot;
+    p->p_gen = gen + 1;
+    p->p_next = g_free;
+    g_free = slot;
+}
+
+static long
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void
+startpeer(struct peer* p, int sfd, const struct sockaddr_storage* addr)
+{
+    peer_set_addr(p, addr);
+    p->p_sfd = sfd;
+    p->p_id = __sync_add_and_fetch(&g_total, 1);
+    __sync_add_and_fetch(&g_current, 1);
+    if(0 == g_opts.ho_loops)
+    {
+        if(0 != pthread_create(&p->p_tid, NULL, handler_service, p))
+        {
+            logger_error("[handler] pthread_create failed\n");
+            p->p_tid = 0;
+            __sync_sub_and_fetch(&g_current, 1);
+            freepeer(p);
+        }
+    }
+    else if(-1 == loop_add(p))
+    {
+        __sync_sub_and_fetch(&g_current, 1);
+        freepeer(p);
+    }
+}
+
+static int
+pushpending(int sfd, const struct sockaddr_storage* addr)
+{
+    struct pending* pd;
+
+    if(g_pendinglen == (unsigned int) g_opts.ho_pending
+            || 0 == g_opts.ho_wait)
+        return -1;
+
+    pd = &g_pending[(g_pendinghead + g_pendinglen) % g_opts.ho_pending];
+    pd->pd_sfd = sfd;
+    pd->pd_addr = *addr;
+    pd->pd_deadline = now_ms() + g_opts.ho_wait;
+    ++g_pendinglen;
+    return 0;
+}
+
+static void
+poppending()
+{
+    g_pendinghead = (g_pendinghead + 1) % g_opts.ho_pending;
+    --g_pendinglen;
+}
+
+/**
+ * Rejects the connections which have waited too long.
+ * Returns how many ms are left till the next deadline or -1.
+ */
+static int
+expirepending(long now)
+{
+    while(0 < g_pendinglen)
+    {
+        struct pending* pd = &g_pending[g_pendinghead];
+        if(pd->pd_deadline > now && !g_isclosing)
+            return pd->pd_deadline - now;
+        logger_warn("[handler] pending sfd=%d expired\n", pd->pd_sfd);
+        peer_reject(pd->pd_sfd);
+        poppending();
+    }
+    return -1;
+}
+
+/**
+ * Gives free slots to the oldest waiting connections.
+ */
+static void
+admitpending()
+{
+    struct peer* p;
+
+    expirepending(now_ms());
+    while(0 < g_pendinglen && !g_isclosing && NULL != (p = allocpeer()))
+    {
+        struct pending pd = g_pending[g_pendinghead];
+        poppending();
+        logger_info("[handler] admitting pending sfd=%d\n", pd.pd_sfd);
+        startpeer(p, pd.pd_sfd, &pd.pd_addr);
+    }
+}
+
+static void
+releasepeer(struct peer* p)
+{
+    freepeer(p);
+    admitpending();
+}
+
+static int
+handler_step(int step)
+{
+    switch(step)
+    {
+        case HANDLER_LOCK:
+            g_chunks = calloc((g_capacity + HANDLER_CHUNK_SIZE - 1)
+                    / HANDLER_CHUNK_SIZE, sizeof(struct peer*));
+            g_pending = malloc(g_opts.ho_pending * sizeof(struct pending));
+            return (NULL == g_chunks || NULL == g_pending) ? -1 : 0;
+        case HANDLER_EPOCH:
+            return epoch_init();
+        case HANDLER_ACCOUNTS:
+            return accounts_init(ACCOUNTS_PATH);
+        case HANDLER_LISTING:
+            return listing_init(1024L * g_opts.ho_cache);
+        case HANDLER_WHO:
+            return who_init();
+        case HANDLER_DIRCACHE:
+            return dircache_init(DIRCACHE_SIZE);
+        case HANDLER_ROOT:
+            if(NULL == g_opts.ho_root)
+                return 0;
+            return peer_setroot(g_opts.ho_root);
+        case HANDLER_LOOPS:
+            if(0 == g_opts.ho_loops)
+                return 0;
+            return loop_init(g_opts.ho_loops, g_opts.ho_workers);
+    }
+    return 0;
+}
+
+/**
+ * Takes apart what handler_init() has set up, from done down. The loops
+ * are not among it: a loop_init() that failed has cleaned up after
+ * itself, and handler_destroy() stops them before the peers go.
+ */
+static void
+handler_undo(int done)
 {
-    logger_log("[handler] initializing...\n");
-    g_peerslen = HANDLER_PEERS_SIZE;
-    g_peers = malloc(g_peerslen * sizeof(struct peer));
-    memset(g_peers, 0, g_peerslen * sizeof(struct peer));
+    if(HANDLER_ROOT <= done)
+        peer_closeroot();
+    if(HANDLER_DIRCACHE <= done)
+        dircache_destroy();
+    if(HANDLER_WHO <= done)
+        who_destroy();
+    if(HANDLER_LISTING <= done)
+        listing_destroy();
+    if(HANDLER_ACCOUNTS <= done)
+        accounts_destroy();
+    if(HANDLER_EPOCH <= done)
+        epoch_destroy();
+    while(0 < g_chunkslen)
+    {
+        free(g_chunks[--g_chunkslen]);
+    }
+    free(g_chunks);
+    free(g_pending);
+    g_chunks = NULL;
+    g_pending = NULL;
+    pthread_mutex_destroy(&g_lock);
+}
+
+int
+handler_init(const struct handler_opts* opts)
+{
+    int step;
+
+    logger_info("[handler] initializing...\n");
+    g_opts = *opts;
+    if(0 < g_opts.ho_workers && 0 == g_opts.ho_loops)
+        g_opts.ho_loops = 1; // the pool needs someone to watch the sockets
+    if(0 >= g_opts.ho_capacity)
+        g_opts.ho_capacity = HANDLER_PEERS_MAX;
+    if(0 >= g_opts.ho_pending)
+        g_opts.ho_pending = HANDLER_PENDING_SIZE;
+    if(0 > g_opts.ho_wait)
+        g_opts.ho_wait = HANDLER_PENDING_WAIT;
+    if(0 > g_opts.ho_cache)
+        g_opts.ho_cache = LISTING_CACHE_SIZE / 1024;
+
+    g_chunkslen = 0;
+    g_free = HANDLER_NO_SLOT;
+    g_capacity = g_opts.ho_capacity;
+    g_pendinghead = 0;
+    g_pendinglen = 0;
+    g_isclosing = 0;
     pthread_mutex_init(&g_lock, NULL);
+    for(step = HANDLER_LOCK; step <= HANDLER_LOOPS; ++step)
+    {
+        if(-1 == handler_step(step))
+        {
+            logger_error("[handler] %s failed: %s\n", g_steps[step],
+                    strerror(errno));
+            handler_undo(step - 1);
+            return -1;
+        }
+    }
+    return 0;
 }
 
 void
 handler_destroy()
 {
-    logger_log("[handler] destroing...\n");
+    logger_info("[handler] destroing...\n");
+    pthread_mutex_lock(&g_lock);
+    g_isclosing = 1;
+    expirepending(now_ms());
+    pthread_mutex_unlock(&g_lock);
+
+    if(0 < g_opts.ho_loops)
+        loop_destroy();
     handler_delete_all_if(&peer_isexist);
-    free(g_peers);
-    pthread_mutex_destroy(&g_lock);
+    handler_undo(HANDLER_ROOT);
 }
 
 peer_t
@@ -55,32 +381,32 @@ handler_gettotal()
 static void*
 handler_service(void* arg)
 {
-    pthread_mutex_lock(&g_lock);
+    unsigned int gen;
     struct peer* ppeer = (struct peer*) arg;
-    if(peer_isnotexist(ppeer))
+
+    pthread_mutex_lock(&g_lock);
+    if(!pthread_equal(ppeer->p_tid, pthread_self()))
     {
         // somehow the peer had been destroyed
         //  before the thread started
         pthread_mutex_unlock(&g_lock);
         return arg;
     }
+    gen = ppeer->p_gen;
     pthread_mutex_unlock(&g_lock);
 
     service(ppeer);
 
-    pthread_detach(ppeer->p_tid);
-    handler_find_first_and_apply(
-            lambda(int, (struct peer* predic)
-                {return ppeer->p_id == predic->p_id;}
-            ),
-            lambda(void, (struct peer* pp)
-                {
-                    logger_log("[handler] Deleting #%d: sfd=%d, tid=%u\n",
-                            pp->p_id, pp->p_sfd, pp->p_tid);
-                    __sync_sub_and_fetch(&g_current, 1);
-                    peer_destroy(pp);
-                }
-            ));
+    pthread_mutex_lock(&g_lock);
+    if(handler_isalive(ppeer, gen))
+    {
+        logger_info("[handler] Deleting #%d: sfd=%d, tid=%lu\n",
+                ppeer->p_id, ppeer->p_sfd, (unsigned long) ppeer->p_tid);
+        pthread_detach(ppeer->p_tid);
+        __sync_sub_and_fetch(&g_current, 1);
+        releasepeer(ppeer);
+    }
+    pthread_mutex_unlock(&g_lock);
     return arg;
 }
 
@@ -88,13 +414,17 @@ static int
 find_first_and_apply(int (*predicate)(struct peer* ppeer),
         void (*consumer)(struct peer* ppeer))
 {
-    const struct peer* peers_end = g_peerslen + g_peers;
-    for(struct peer* p = g_peers; peers_end != p; ++p)
+    unsigned int c;
+    for(c = 0; c < g_chunkslen; ++c)
     {
-        if(predicate(p))
+        const struct peer* chunk_end = g_chunks[c] + HANDLER_CHUNK_SIZE;
+        for(struct peer* p = g_chunks[c]; chunk_end != p; ++p)
         {
-            consumer(p);
-            return 1;
+            if(predicate(p))
+            {
+                consumer(p);
+                return 1;
+            }
         }
     }
     return 0;
@@ -104,14 +434,18 @@ static int
 find_all_and_apply(int (*predicate)(struct peer* ppeer),
         void (*consumer)(struct peer* ppeer))
 {
+    unsigned int c;
     int wasfound = 0;
-    const struct peer* peers_end = g_peerslen + g_peers;
-    for(struct peer* p = g_peers; peers_end != p; ++p)
+    for(c = 0; c < g_chunkslen; ++c)
     {
-        if(predicate(p))
+        const struct peer* chunk_end = g_chunks[c] + HANDLER_CHUNK_SIZE;
+        for(struct peer* p = g_chunks[c]; chunk_end != p; ++p)
         {
-            wasfound = 1;
-            consumer(p);
+            if(predicate(p))
+            {
+                wasfound = 1;
+                consumer(p);
+            }
         }
     }
     return wasfound;
@@ -120,42 +454,85 @@ find_all_and_apply(int (*predicate)(struct peer* ppeer),
 static void
 deletepeer(struct peer* ppeer)
 {
-    logger_log("[handler] Deleting the peer #%d: sfd=%d, tid=%u\n",
-            ppeer->p_id, ppeer->p_sfd, ppeer->p_tid);
+    if(NULL != ppeer->p_loop && loop_isrunning())
+    {
+        logger_info("[handler] Killing the peer #%d: sfd=%d\n",
+                ppeer->p_id, ppeer->p_sfd);
+        loop_kill(ppeer);
+        return;
+    }
+
+    logger_info("[handler] Deleting the peer #%d: sfd=%d, tid=%lu\n",
+            ppeer->p_id, ppeer->p_sfd, (unsigned long) ppeer->p_tid);
     __sync_sub_and_fetch(&g_current, 1);
-    pthread_cancel(ppeer->p_tid);
-    pthread_join(ppeer->p_tid, NULL);
-    peer_destroy(ppeer);
+    if(0 != ppeer->p_tid)
+    {
+        pthread_cancel(ppeer->p_tid);
+        pthread_join(ppeer->p_tid, NULL);
+    }
+    releasepeer(ppeer);
 }
 
+/**
+ * If there is no free slot, the connection waits for one
+ * in the pending queue. If the queue is full, it is rejected at once.
+ */
 void
-handler_new(int sfd)
+handler_new(int sfd, const struct sockaddr_storage* addr)
 {
+    struct peer* p;
+
     pthread_mutex_lock(&g_lock);
-    logger_log("[handler] new peer sfd=%d\n", sfd);
-    while(1)
-    {
-        int isfound = find_first_and_apply(
-                &peer_isnotexist,
-                lambda(void, (struct peer* p)
-                    {
-                        p->p_sfd = sfd;
-                        p->p_id = __sync_add_and_fetch(&g_total, 1);
-                        __sync_add_and_fetch(&g_current, 1);
-                        pthread_create(&p->p_tid, NULL, handler_service, p);
-                    })
-            );
-        if(isfound)
-        {
-            break;
-        }
-        else if(g_peerslen < HANDLER_PEERS_SIZE)
-        {
-            logger_log("[handler] Reached the peers limit\n");
-            peer_closesocket(sfd);
-            break;
-        }
+    logger_info("[handler] new peer sfd=%d\n", sfd);
+    p = (0 == g_pendinglen) ? allocpeer() : NULL;
+    if(NULL != p)
+    {
+        startpeer(p, sfd, addr);
+    }
+    else if(0 == pushpending(sfd, addr))
+    {
+        logger_info("[handler] Reached the peers limit, sfd=%d waits\n", sfd);
+        admitpending();
     }
+    else
+    {
+        logger_warn("[handler] Reached the peers limit, sfd=%d rejected\n",
+                sfd);
+        peer_reject(sfd);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+int
+handler_expire()
+{
+    int rv;
+    pthread_mutex_lock(&g_lock);
+    rv = expirepending(now_ms());
+    pthread_mutex_unlock(&g_lock);
+    return rv;
+}
+
+/**
+ * Tells whether the peer is still the one which had the generation.
+ */
+int
+handler_isalive(struct peer* ppeer, unsigned int gen)
+{
+    return gen == ppeer->p_gen && peer_isexist(ppeer);
+}
+
+/**
+ * Called by an event loop when its peer has gone.
+ */
+void
+handler_release(struct peer* ppeer)
+{
+    pthread_mutex_lock(&g_lock);
+    logger_info("[handler] Releasing the peer #%d: sfd=%d\n",
+            ppeer->p_id, ppeer->p_sfd);
+    __sync_sub_and_fetch(&g_current, 1);
+    releasepeer(ppeer);
     pthread_mutex_unlock(&g_lock);
 }
 
@@ -164,7 +541,7 @@ handler_delete_first_if(int (*predicate)(struct peer* ppeer))
 {
     int rv;
     pthread_mutex_lock(&g_lock);
-    logger_log("[handler] delete first\n");
+    logger_info("[handler] delete first\n");
     rv = find_first_and_apply(predicate, &deletepeer);
     pthread_mutex_unlock(&g_lock);
     return rv;
@@ -175,19 +552,36 @@ handler_delete_all_if(int (*predicate)(struct peer* ppeer))
 {
     int rv;
     pthread_mutex_lock(&g_lock);
-    logger_log("[handler] delete all\n");
+    logger_info("[handler] delete all\n");
     rv = find_all_and_apply(predicate, &deletepeer);
     pthread_mutex_unlock(&g_lock);
     return rv;
 }
 
+/**
+ * Does not block anybody: the callback may see a peer which is being
+ * connected or destroyed, so it must cope with missing fields.
+ * The callback must not retire anything to the epoch module.
+ */
 void
 handler_foreach(void (*cb)(struct peer* p))
 {
-    pthread_mutex_lock(&g_lock);
-    logger_log("[handler] foreach\n");
-    find_all_and_apply(&peer_isexist, cb);
-    pthread_mutex_unlock(&g_lock);
+    unsigned int c;
+    unsigned int chunkslen;
+    unsigned int epoch = epoch_enter();
+
+    logger_debug("[handler] foreach\n");
+    chunkslen = __sync_or_and_fetch(&g_chunkslen, 0);
+    for(c = 0; c < chunkslen; ++c)
+    {
+        const struct peer* chunk_end = g_chunks[c] + HANDLER_CHUNK_SIZE;
+        for(struct peer* p = g_chunks[c]; chunk_end != p; ++p)
+        {
+            if(peer_isexist(p))
+                cb(p);
+        }
+    }
+    epoch_exit(epoch);
 }
 
 int
@@ -9,14 +9,34 @@
           __fn__; \
 })
 
-void
-handler_init();
+struct handler_opts
+{
+    int ho_loops; // 0 means a thread per peer
+    int ho_workers; // 0 means requests are done by the loops
+    int ho_capacity; // the peers limit
+    int ho_pending; // connections waiting for a free slot
+    int ho_wait; // ms a connection may wait, 0 means rejecting at once
+    int ho_cache; // KiB of cached LS listings, 0 turns the cache off
+    const char* ho_root; // the peers stay beneath it, NULL for anywhere
+};
+
+int
+handler_init(const struct handler_opts* opts);
 
 void
 handler_destroy();
 
 void
-handler_new(int sfd);
+handler_new(int sfd, const struct sockaddr_storage* addr);
+
+int
+handler_expire();
+
+void
+handler_release(struct peer* ppeer);
+
+int
+handler_isalive(struct peer* ppeer, unsigned int gen);
 
 peer_t
 handler_getcurrent();
@@ -1,69 +1,55 @@
+#include "lib/efunc.h"
+#include "lib/termproto.h"
 #include "logger/logger.h"
+#include "server/dircache/dircache.h"
+#include "server/epoch/epoch.h"
 #include "server/handler/peer/peer.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <linux/openat2.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_PEER
+
+static int g_rootfd = -1;
+static char* g_rootpath; // NULL unless the peers are confined
+static size_t g_rootlen;
+
 /**
  * This function uses printf(), because it has to print details
  * to stdout on a request from the <terminal> module.
+ * It is called without locks, so the peer may be gone meanwhile.
  */
 void
 peer_printinfo(struct peer* p)
 {
-    int port = p->p_port;
     unsigned int ip = p->p_ip;
     char mode = peer_get_mode(p);
+    char* username = peer_get_username(p);
+    char* cwdpath = peer_get_cwdpath(p);
     char ipstr[INET_ADDRSTRLEN];
 
-    if(0 == port)
-    {
-        int rv;
-        struct sockaddr_storage addr;
-        socklen_t len = sizeof addr;
-
-        logger_log("[peer] no cache for Peer#%hd\n", p->p_id);
-        rv = getpeername(p->p_sfd, (struct sockaddr*) &addr, &len);
-        if(-1 == rv)
-        {
-            logger_log("[peer] getpeername failed for Peer#%hd\n",
-                    p->p_id);
-            return;
-        }
-
-        if(AF_INET == addr.ss_family)
-        {
-            struct sockaddr_in *s = (struct sockaddr_in*) &addr;
-            port = ntohs(s->sin_port); 
-            ip = (unsigned int) s->sin_addr.s_addr;
-
-            p->p_port = port;
-            p->p_ip = ip;
-        }
-        else
-        {
-            printf("Peer#%d has unsupported adress family\n",
-                    p->p_id);
-            return;
-        }
-    }
     inet_ntop(AF_INET, &ip, ipstr, sizeof ipstr);
 
     printf("Peer #%d\n\tIP address: %s\n\tPort: %d\n\t"
             "Socket: %d\n",
-            p->p_id, ipstr, port, p->p_sfd);
-    if(PEER_NO_PERMS != mode)
+            p->p_id, ipstr, p->p_port, p->p_sfd);
+    if(PEER_NO_PERMS != mode && NULL != username && NULL != cwdpath)
     {
         printf("\tUsername: %s\n\tCWD: %s\n\tMode: %d\n",
-                p->p_username, p->p_cwdpath, mode);
+                username, cwdpath, mode);
     }
     else
     {
@@ -77,22 +63,26 @@ peer_destroy(struct peer* p)
     peer_closesocket(p->p_sfd);
     if(STDIN_FILENO != p->p_cwd)
         close(p->p_cwd);
-    free(p->p_username);
+    epoch_retire(p->p_username);
     free(p->p_buffer);
-    free(p->p_cwdpath);
+    epoch_retire(p->p_cwdpath);
+    free(p->p_cwdreal);
+    iobuf_free(&p->p_in);
+    iobuf_free(&p->p_out);
+    compress_free(p->p_zip);
     memset(p, 0, sizeof(struct peer));
 }
 
 int
 peer_isexist(struct peer* p)
 {
-    return 0 != p->p_tid;
+    return 0 != p->p_tid || NULL != p->p_loop;
 }
 
 int
 peer_isnotexist(struct peer* p)
 {
-    return 0 == p->p_tid;
+    return 0 == p->p_tid && NULL == p->p_loop;
 }
 
 void
@@ -102,6 +92,203 @@ peer_closesocket(int sfd)
     close(sfd);
 }
 
+/**
+ * Responses are only queued, so the answers to pipelined requests
+ * leave in one write: the event loop flushes them once the socket is
+ * writable, a peer thread calls peer_flush() before it blocks in recv().
+ */
+int
+peer_send(struct peer* p, const char* buf, size_t size)
+{
+    return iobuf_append(&p->p_out, buf, size);
+}
+
+static void
+queuev(struct peer* p, const struct iovec* iov, int iovcnt, size_t skip)
+{
+    int i;
+
+    for(i = 0; i < iovcnt; ++i)
+    {
+        if(skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        iobuf_append(&p->p_out, (char*) iov[i].iov_base + skip,
+                iov[i].iov_len - skip);
+        skip = 0;
+    }
+}
+
+/**
+ * Sends a response made of several segments, e.g. a header and a body,
+ * without gluing them together first. Short ones are just queued.
+ * Long ones go out in one sendmsg() right behind whatever is queued.
+ * The peer thread keeps the segment corked with MSG_MORE while the
+ * batch has more requests. A loop only sends what fits into the
+ * socket and queues the rest.
+ */
+int
+peer_sendv(struct peer* p, const struct iovec* iov, int iovcnt)
+{
+    int i;
+    int flags = MSG_NOSIGNAL;
+    ssize_t rc;
+    size_t total = 0;
+    size_t queued = iobuf_size(&p->p_out);
+    size_t sent = 0;
+    struct iovec v[PEER_IOV_MAX + 1];
+    struct msghdr msg;
+
+    for(i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+    if(total < PEER_COPY_MAX || iovcnt > PEER_IOV_MAX)
+    {
+        queuev(p, iov, iovcnt, 0);
+        return 0;
+    }
+
+    v[0].iov_base = p->p_out.b_data + p->p_out.b_off;
+    v[0].iov_len = queued;
+    memcpy(v + 1, iov, iovcnt * sizeof(struct iovec));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = iovcnt + 1;
+    total += queued;
+    if(NULL == p->p_loop && peer_haspending(p))
+        flags |= MSG_MORE;
+
+    while(sent < total)
+    {
+        rc = sendmsg(p->p_sfd, &msg, flags);
+        if(0 > rc)
+        {
+            if(EINTR == errno)
+                continue;
+            if(NULL == p->p_loop)
+                return -1;
+            break; // the loop sees an error again on its flush
+        }
+        sent += rc;
+        while(0 < msg.msg_iovlen && (size_t) rc >= msg.msg_iov->iov_len)
+        {
+            rc -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if(0 < msg.msg_iovlen)
+        {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + rc;
+            msg.msg_iov->iov_len -= rc;
+        }
+    }
+
+    // the queued bytes are first, the rest of the segments follow them
+    if(sent < queued)
+    {
+        iobuf_consume(&p->p_out, sent);
+        queuev(p, iov, iovcnt, 0);
+    }
+    else
+    {
+        iobuf_consume(&p->p_out, queued);
+        queuev(p, iov, iovcnt, sent - queued);
+    }
+    return 0;
+}
+
+/**
+ * Sends everything queued by peer_send(), blocking if it has to.
+ * Not for peers driven by an event loop, their sockets are non-blocking.
+ */
+int
+peer_flush(struct peer* p)
+{
+    int rv;
+    size_t size = iobuf_size(&p->p_out);
+
+    if(0 == size)
+        return 0;
+    rv = sendall(p->p_sfd, p->p_out.b_data + p->p_out.b_off, &size);
+    iobuf_consume(&p->p_out, size);
+    return rv;
+}
+
+/**
+ * Holds a long response of a loop's peer back, as the blocking socket
+ * does for a peer thread: once p_out reaches PEER_OUT_HIGH, it waits
+ * for the socket to take the rest. It blocks the thread, so only a pool
+ * worker (p_isworker) may call it, never a loop. Returns -1 if the peer
+ * has to be dropped, e.g. after PEER_STALL_MS without progress.
+ */
+int
+peer_pace(struct peer* p)
+{
+    ssize_t rc;
+    struct pollfd pfd;
+    struct iobuf* out = &p->p_out;
+
+    pfd.fd = p->p_sfd;
+    pfd.events = POLLOUT;
+    while(NULL != p->p_loop && PEER_OUT_HIGH <= iobuf_size(out))
+    {
+        rc = send(p->p_sfd, out->b_data + out->b_off, iobuf_size(out),
+                MSG_NOSIGNAL);
+        if(0 <= rc)
+        {
+            iobuf_consume(out, rc);
+            continue;
+        }
+        if(EINTR == errno)
+            continue;
+        if(EAGAIN != errno && EWOULDBLOCK != errno)
+            return -1;
+        rc = poll(&pfd, 1, PEER_STALL_MS);
+        if(0 == rc)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(-1 == rc && EINTR != errno)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Whether p_in holds another complete request: a line or, in the binary
+ * revision, a frame. Input service_next() rejects, a bad frame or a line
+ * that cannot fit, counts too, or a loop would wait for more instead.
+ */
+int
+peer_haspending(struct peer* p)
+{
+    size_t size = iobuf_size(&p->p_in);
+    size_t len;
+
+    if(TERM_PROTO_BIN != p->p_proto)
+        return iobuf_hasline(&p->p_in) || TERMPROTO_BUF_SIZE <= size;
+    len = term_bin_reqlen(p->p_in.b_data + p->p_in.b_off, size);
+    return 0 < len && (len <= size || TERMPROTO_BUF_SIZE < len);
+}
+
+/**
+ * Tells the peer that the server is busy and hangs up. It never blocks,
+ * the status line fits into an empty socket buffer anyway.
+ */
+void
+peer_reject(int sfd)
+{
+    char resp[32];
+    size_t size = term_put_header(resp, sizeof(resp), TERM_PROTO_1,
+            SERVICE_UNAVAILABLE, 0, 0);
+
+    send(sfd, resp, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(sfd, SHUT_WR);
+    close(sfd);
+}
+
 char
 peer_get_mode(struct peer* p)
 {
@@ -114,54 +301,262 @@ peer_set_mode(struct peer* p, char mode)
     __sync_add_and_fetch(&p->p_mode, mode);
 }
 
+void
+peer_set_addr(struct peer* p, const struct sockaddr_storage* addr)
+{
+    if(AF_INET == addr->ss_family)
+    {
+        const struct sockaddr_in *s = (const struct sockaddr_in*) addr;
+        p->p_port = ntohs(s->sin_port);
+        p->p_ip = (unsigned int) s->sin_addr.s_addr;
+    }
+}
+
+/**
+ * Replaces the string with a full barrier, so a reader which sees
+ * the new pointer sees the whole string as well.
+ */
+static char*
+publish(char** dst, char* src)
+{
+    char* old;
+    do
+    {
+        old = *dst;
+    } while(old != __sync_val_compare_and_swap(dst, old, src));
+    return old;
+}
+
+char*
+peer_get_username(struct peer* p)
+{
+    return __sync_or_and_fetch(&p->p_username, 0);
+}
+
 int
-peer_set_cwd(struct peer* p, const char* path, int psize)
+peer_set_username(struct peer* p, const char* username)
 {
-    int dirfd;
-    struct stat path_stat;
+    char* name = strdup(username);
+    if(NULL == name)
+        return -1;
+    epoch_retire(publish(&p->p_username, name));
+    return 0;
+}
 
-    char* resolved;
-    if('/' != path[0])
+char*
+peer_get_cwdpath(struct peer* p)
+{
+    return __sync_or_and_fetch(&p->p_cwdpath, 0);
+}
+
+int
+peer_setroot(const char* path)
+{
+    g_rootpath = realpath(path, NULL);
+    if(NULL != g_rootpath)
+        g_rootfd = open(g_rootpath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(NULL == g_rootpath || -1 == g_rootfd)
     {
-        char buf[2 * psize];
-        sprintf(buf, "%s/%s", p->p_cwdpath, path);
-        resolved = realpath(buf, NULL);
+        logger_error("[peer] bad root %s: %s\n", path, strerror(errno));
+        free(g_rootpath);
+        g_rootpath = NULL;
+        return -1;
     }
-    else
+    g_rootlen = strlen(g_rootpath);
+    logger_info("[peer] peers are confined to %s\n", g_rootpath);
+    return 0;
+}
+
+void
+peer_closeroot()
+{
+    if(NULL != g_rootpath)
     {
-        resolved = realpath(path, NULL);
+        close(g_rootfd);
+        free(g_rootpath);
+        g_rootfd = -1;
+        g_rootpath = NULL;
     }
+}
 
-    if(NULL == resolved)
-    {
-        logger_log("[peer] realpath failed for: path=%s\n", path);
+int
+peer_isconfined()
+{
+    return NULL != g_rootpath;
+}
+
+static int
+opendir_path(int dirfd, const char* path, unsigned long long resolve)
+{
+    struct open_how how;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = resolve;
+    return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+/**
+ * The kernel refuses to climb out of the current directory beneath
+ * the root, so such a path is resolved from the root instead.
+ */
+static int
+opendir_up(struct peer* p, const char* path, unsigned long long resolve)
+{
+    int dirfd;
+    char* cwdpath = peer_show_cwd(p);
+    char* joined;
+
+    if(NULL == cwdpath)
+        return -1;
+    joined = malloc(strlen(cwdpath) + strlen(path) + 2);
+    if(NULL == joined)
         return -1;
+    sprintf(joined, "%s/%s", cwdpath, path);
+    dirfd = opendir_path(g_rootfd, joined, RESOLVE_IN_ROOT | resolve);
+    free(joined);
+    return dirfd;
+}
+
+static int
+opendir_from(struct peer* p, const char* path, unsigned long long resolve)
+{
+    int dirfd;
+
+    if(NULL == g_rootpath)
+        return opendir_path((0 != p->p_cwd) ? p->p_cwd : AT_FDCWD, path,
+                resolve);
+    if('/' == path[0] || 0 == p->p_cwd)
+        return opendir_path(g_rootfd, path, RESOLVE_IN_ROOT | resolve);
+
+    dirfd = opendir_path(p->p_cwd, path, RESOLVE_BENEATH | resolve);
+    if(-1 == dirfd && EXDEV == errno)
+        dirfd = opendir_up(p, path, resolve);
+    return dirfd;
+}
+
+int
+peer_resolve(struct peer* p, const char* path)
+{
+    return opendir_from(p, path, 0);
+}
+
+static char*
+fd_path(int fd)
+{
+    char link[32];
+    char buf[PATH_MAX];
+    ssize_t len;
+
+    sprintf(link, "/proc/self/fd/%d", fd);
+    len = readlink(link, buf, sizeof(buf) - 1);
+    if(-1 == len)
+    {
+        logger_error("[peer] readlink failed: %s\n", strerror(errno));
+        return NULL;
     }
+    buf[len] = '\0';
+    return strdup(buf);
+}
+
+/**
+ * The real path of the current directory, read from /proc only once
+ * somebody needs it.
+ */
+static const char*
+cwd_real(struct peer* p)
+{
+    if(NULL == p->p_cwdreal && 0 != p->p_cwd)
+        p->p_cwdreal = fd_path(p->p_cwd);
+    return p->p_cwdreal;
+}
 
-    dirfd = open(resolved, O_RDONLY);
-    if(-1 == dirfd)
+/**
+ * Resolves the path without the dircache. One without symlinks is
+ * remembered there for the next time, that also gives d->d_path;
+ * otherwise it is left NULL until the path is shown.
+ */
+static int
+opendir_new(struct peer* p, const char* path, struct dircache_dir* d)
+{
+    struct stat st;
+    int iskept = ('/' == path[0] || NULL != cwd_real(p));
+
+    d->d_path = NULL;
+    d->d_fd = opendir_from(p, path, RESOLVE_NO_SYMLINKS);
+    if(-1 == d->d_fd && ELOOP == errno)
     {
-        logger_log("[peer] truncated?\npath=%s\n", resolved);
-        free(resolved);
+        iskept = 0;
+        d->d_fd = opendir_from(p, path, 0);
+    }
+    if(-1 == d->d_fd)
+        return -1;
+    if(-1 == fstat(d->d_fd, &st))
+    {
+        close(d->d_fd);
         return -1;
     }
+    d->d_dev = st.st_dev;
+    d->d_ino = st.st_ino;
+
+    if(iskept && '/' == path[0])
+        dircache_add(0, 0, "/", (NULL != g_rootpath) ? g_rootpath : "/",
+                path, d);
+    else if(iskept)
+        dircache_add(p->p_cwddev, p->p_cwdino, p->p_cwdreal,
+                (NULL != g_rootpath) ? g_rootpath : "/", path, d);
+    return 0;
+}
+
+int
+peer_set_cwd(struct peer* p, const char* path)
+{
+    struct dircache_dir d;
+    int isabs = ('/' == path[0]);
 
-    fstat(dirfd, &path_stat);
-    if(!S_ISDIR(path_stat.st_mode))
+    if(-1 == dircache_find(isabs ? 0 : p->p_cwddev, isabs ? 0 : p->p_cwdino,
+                path, &d) && -1 == opendir_new(p, path, &d))
     {
-        errno = ENOTDIR;
-        close(dirfd);
-        free(resolved);
+        logger_debug("[peer] openat2 failed for: path=%s\n", path);
         return -1;
     }
 
-    free(p->p_cwdpath);
-    p->p_cwdpath = resolved;
-
     if(0 != p->p_cwd)
     {
         close(p->p_cwd);
     }
-    p->p_cwd = dirfd;
+    free(p->p_cwdreal);
+    p->p_cwd = d.d_fd;
+    p->p_cwdreal = d.d_path;
+    p->p_cwddev = d.d_dev;
+    p->p_cwdino = d.d_ino;
+    p->p_iscwdstale = 1;
     return 0;
 }
+
+char*
+peer_show_cwd(struct peer* p)
+{
+    const char* shown;
+    char* path;
+
+    if(!p->p_iscwdstale || NULL == (shown = cwd_real(p)))
+        return peer_get_cwdpath(p);
+
+    // the root is shown as "/" to the confined peers
+    if(NULL != g_rootpath && 1 < g_rootlen
+            && 0 == strncmp(shown, g_rootpath, g_rootlen))
+    {
+        if('\0' == shown[g_rootlen])
+            shown = "/";
+        else if('/' == shown[g_rootlen])
+            shown += g_rootlen;
+    }
+
+    path = strdup(shown);
+    if(NULL == path)
+        return peer_get_cwdpath(p);
+    epoch_retire(publish(&p->p_cwdpath, path));
+    p->p_iscwdstale = 0;
+    return path;
+}
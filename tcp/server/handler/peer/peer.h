@@ -1,29 +1,67 @@
 #ifndef PEER_H
 #define PEER_H
 
+#include "lib/iobuf.h"
+#include "server/compress/compress.h"
+
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define PEER_NO_PERMS 0
 #define PEER_REGULAR 1
 #define PEER_SUPER 2
 
-typedef unsigned short int peer_t;
+#define PEER_OUT_HIGH (64 * 1024) // flush a batch early past this size
+#define PEER_STALL_MS (30 * 1000) // a loop's peer paced longer is dropped
+#define PEER_COPY_MAX 2048 // shorter responses are queued by copying
+#define PEER_IOV_MAX 8
+
+typedef unsigned int peer_t;
 
 struct peer
 {
+    /* the slot in the handler's registry, kept across peer_destroy() */
+    unsigned int p_slot;
+    unsigned int p_gen;
+    unsigned int p_next;
+
     peer_t p_id;
     pthread_t p_tid;
     int p_sfd;
     char* p_buffer;
     size_t p_buflen;
 
-    /* could be modified from multiple threads */
+    /* requests come in and responses queue up until peer_flush() */
+    struct iobuf p_in;
+    struct iobuf p_out;
+
+    /* used only when the peer is driven by an event loop */
+    void* p_loop;
+    char p_isclosing;
+    char p_isworker; // served by a pool worker now, not by the loop
+
+    /* set before the peer is started */
     int p_port;
     unsigned int p_ip; // struct in_addr
+
+    /*
+     * Written only by the thread serving the peer, read by others
+     * without locks: strings are replaced as a whole and the old ones
+     * are retired to the epoch module.
+     */
     char* p_username; // null-terminated
     char p_mode;
-    int p_cwd;
+    int p_cwd; // O_PATH
     char* p_cwdpath; // null-terminated
+    char p_iscwdstale; // the path is built when it is shown
+    char* p_cwdreal; // the real path of p_cwd once needed, for this thread
+    dev_t p_cwddev;
+    ino_t p_cwdino;
+    char p_proto; // the revision agreed on, 0 until PROTO
+    unsigned short p_reqid; // of the request being answered
+    struct compress* p_zip; // NULL unless the peer asked for deflate
 };
     
 void
@@ -41,16 +79,73 @@ peer_isnotexist(struct peer* p);
 void
 peer_closesocket(int sfd);
 
+void
+peer_reject(int sfd);
+
 void
 peer_handle(struct peer* p);
 
+int
+peer_send(struct peer* p, const char* buf, size_t size);
+
+int
+peer_sendv(struct peer* p, const struct iovec* iov, int iovcnt);
+
+int
+peer_flush(struct peer* p);
+
+int
+peer_pace(struct peer* p);
+
+int
+peer_haspending(struct peer* p);
+
 char
 peer_get_mode(struct peer* p);
 
 void
 peer_set_mode(struct peer* p, char mode);
 
+void
+peer_set_addr(struct peer* p, const struct sockaddr_storage* addr);
+
+char*
+peer_get_username(struct peer* p);
+
+int
+peer_set_username(struct peer* p, const char* username);
+
+char*
+peer_get_cwdpath(struct peer* p);
+
+/**
+ * Confines the peers beneath the directory: absolute paths start there
+ * and ".." does not leave it.
+ */
+int
+peer_setroot(const char* path);
+
+void
+peer_closeroot();
+
+int
+peer_isconfined();
+
+/**
+ * Opens the directory with O_PATH, resolved from the current one of
+ * the peer. Returns -1 with errno set on failure.
+ */
+int
+peer_resolve(struct peer* p, const char* path);
+
 int
-peer_set_cwd(struct peer* p, const char* path, int psize);
+peer_set_cwd(struct peer* p, const char* path);
+
+/**
+ * Builds the path of the current directory, if it has changed since
+ * it was shown last. Only the thread serving the peer may call it.
+ */
+char*
+peer_show_cwd(struct peer* p);
 
 #endif
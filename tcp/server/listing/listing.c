@@ -0,0 +1,880 @@
+#include "lib/iobuf.h"
+#include "logger/logger.h"
+#include "server/listing/listing.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_LISTING
+
+/*
+ * Every thread doing requests (a peer thread, a loop or a worker) keeps
+ * one arena: the raw getdents64() batch and the rendered body. Both are
+ * reused by the next LS of the thread and freed when it exits.
+ */
+struct arena
+{
+    char* a_dents;
+    struct iobuf a_body;
+};
+
+/*
+ * A cached listing of the directory (e_dev, e_ino) as it was at the
+ * stamps. The cache holds one reference while the entry is linked,
+ * every reader holds one until listing_put(); the last one frees it.
+ */
+struct entry
+{
+    struct entry* e_next; // in the bucket
+    struct entry* e_newer;
+    struct entry* e_older;
+    dev_t e_dev;
+    ino_t e_ino;
+    struct timespec e_mtim;
+    struct timespec e_ctim;
+    int e_refs;
+    size_t e_len;
+    char e_data[];
+};
+
+/*
+ * A rendered part of a streamed listing, kept for those who follow it.
+ */
+struct part
+{
+    struct part* pt_next;
+    size_t pt_len;
+    char pt_data[];
+};
+
+/*
+ * A read in progress. Requests for the same directory in the same
+ * state wait for it instead of reading the directory themselves,
+ * then share the entry it made. A streamed read keeps its parts, so
+ * others streaming the listing replay them and follow the rest.
+ */
+struct flight
+{
+    struct flight* f_next;
+    dev_t f_dev;
+    ino_t f_ino;
+    struct timespec f_mtim;
+    struct timespec f_ctim;
+    int f_refs; // the reader and its waiters
+    int f_isdone;
+    int f_err;
+    int f_islinked; // others can still find it
+    int f_isstream;
+    struct part* f_parts;
+    struct part** f_tail;
+    size_t f_size; // of the parts
+    struct entry* f_result;
+    pthread_cond_t f_cond;
+};
+
+/*
+ * What the leader of a streamed read needs to hand its parts on.
+ */
+struct lead
+{
+    struct flight* ld_flight;
+    listing_sink_t ld_sink;
+    void* ld_arg;
+    int ld_err; // of the sink, the read goes on for the followers
+};
+
+/*
+ * A follower may be cancelled in the sink or in the wait, c_mx is held
+ * only in the latter.
+ */
+struct follow
+{
+    struct flight* fw_flight;
+    int fw_islocked;
+};
+
+struct cache
+{
+    pthread_mutex_t c_mx;
+    struct entry* c_buckets[LISTING_BUCKETS];
+    struct flight* c_flights;
+    struct entry* c_newest;
+    struct entry* c_oldest;
+    size_t c_size; // bytes of the linked entries
+    size_t c_budget;
+    size_t c_len;
+
+    unsigned long c_hits;
+    unsigned long c_misses;
+    unsigned long c_stale;
+    unsigned long c_evicted;
+    unsigned long c_coalesced;
+};
+
+static pthread_key_t g_key;
+static struct cache g_cache;
+
+static void
+arena_free(void* arg)
+{
+    struct arena* a = (struct arena*) arg;
+
+    free(a->a_dents);
+    iobuf_free(&a->a_body);
+    free(a);
+}
+
+static struct arena*
+arena_get()
+{
+    struct arena* a = pthread_getspecific(g_key);
+
+    if(NULL != a)
+        return a;
+
+    a = malloc(sizeof(struct arena));
+    if(NULL == a)
+        return NULL;
+    a->a_dents = malloc(LISTING_DENTS_SIZE);
+    if(NULL == a->a_dents || -1 == iobuf_init(&a->a_body, LISTING_BODY_SIZE)
+            || 0 != pthread_setspecific(g_key, a))
+    {
+        free(a->a_dents);
+        iobuf_free(&a->a_body);
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+/**
+ * Renders the entries of a getdents64() batch as "name[/]\r\n" lines,
+ * skipping the hidden ones.
+ */
+static int
+render(struct iobuf* body, const char* dents, ssize_t n)
+{
+    ssize_t off;
+    size_t len;
+    const struct dirent64* d;
+
+    for(off = 0; off < n; off += d->d_reclen)
+    {
+        d = (const struct dirent64*) (dents + off);
+        if('.' == d->d_name[0])
+            continue;
+
+        len = strlen(d->d_name);
+        if(-1 == iobuf_reserve(body, len + 3))
+            return -1;
+        memcpy(body->b_data + body->b_len, d->d_name, len);
+        body->b_len += len;
+        if(DT_DIR == d->d_type)
+            body->b_data[body->b_len++] = '/';
+        body->b_data[body->b_len++] = '\r';
+        body->b_data[body->b_len++] = '\n';
+    }
+    return 0;
+}
+
+/**
+ * Reads the directory in one pass with large getdents64() batches
+ * into the thread's arena. With a sink every batch is handed to it as
+ * soon as it is rendered; once the body outgrows keep, the parts
+ * already handed over are dropped and 1 is returned.
+ */
+static int
+readdir_all(int fd, struct arena* a, listing_sink_t sink, void* arg,
+        size_t keep)
+{
+    ssize_t n;
+    size_t sent = 0;
+    int isdropped = 0;
+    struct iobuf* body = &a->a_body;
+
+    // a huge listing should not pin its memory to the thread forever
+    if(LISTING_KEEP_MAX < a->a_body.b_cap)
+    {
+        iobuf_free(&a->a_body);
+        if(-1 == iobuf_init(&a->a_body, LISTING_BODY_SIZE))
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    iobuf_consume(&a->a_body, iobuf_size(&a->a_body));
+
+    while(0 < (n = getdents64(fd, a->a_dents, LISTING_DENTS_SIZE)))
+    {
+        if(-1 == render(body, a->a_dents, n))
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        if(NULL == sink || sent == iobuf_size(body))
+            continue;
+        if(-1 == sink(arg, body->b_data + body->b_off + sent,
+                    iobuf_size(body) - sent))
+            return -1;
+        sent = iobuf_size(body);
+        if(sent > keep)
+        {
+            // it will not be cached, there is no point to hold it
+            iobuf_consume(body, sent);
+            sent = 0;
+            isdropped = 1;
+        }
+    }
+    if(0 > n)
+        return -1;
+    return isdropped;
+}
+
+static size_t
+bucket(dev_t dev, ino_t ino)
+{
+    return (size_t) ((ino * 0x9e3779b97f4a7c15ULL) ^ dev) % LISTING_BUCKETS;
+}
+
+static int
+samestamp(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * A directory changed within the last timestamp tick may change again
+ * without its stamps moving, so such a listing is not kept.
+ */
+static int
+isracy(const struct stat* st)
+{
+    struct timespec now;
+    const struct timespec* t = &st->st_mtim;
+
+    if(st->st_ctim.tv_sec > t->tv_sec || (st->st_ctim.tv_sec == t->tv_sec
+                && st->st_ctim.tv_nsec > t->tv_nsec))
+        t = &st->st_ctim;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec - t->tv_sec) * 1000
+        + (now.tv_nsec - t->tv_nsec) / 1000000 < LISTING_RACY_MS;
+}
+
+static void
+entry_put(struct entry* e)
+{
+    if(0 == __sync_sub_and_fetch(&e->e_refs, 1))
+        free(e);
+}
+
+/* the following work under c_mx */
+
+static void
+lru_unlink(struct cache* c, struct entry* e)
+{
+    if(NULL != e->e_newer)
+        e->e_newer->e_older = e->e_older;
+    else
+        c->c_newest = e->e_older;
+    if(NULL != e->e_older)
+        e->e_older->e_newer = e->e_newer;
+    else
+        c->c_oldest = e->e_newer;
+}
+
+static void
+lru_push(struct cache* c, struct entry* e)
+{
+    e->e_newer = NULL;
+    e->e_older = c->c_newest;
+    if(NULL != c->c_newest)
+        c->c_newest->e_newer = e;
+    c->c_newest = e;
+    if(NULL == c->c_oldest)
+        c->c_oldest = e;
+}
+
+static struct entry**
+lookup(struct cache* c, dev_t dev, ino_t ino)
+{
+    struct entry** pe = &c->c_buckets[bucket(dev, ino)];
+
+    while(NULL != *pe && ((*pe)->e_dev != dev || (*pe)->e_ino != ino))
+        pe = &(*pe)->e_next;
+    return pe;
+}
+
+static void
+unlink_entry(struct cache* c, struct entry** pe)
+{
+    struct entry* e = *pe;
+
+    *pe = e->e_next;
+    lru_unlink(c, e);
+    c->c_size -= e->e_len;
+    --c->c_len;
+    entry_put(e);
+}
+
+static void
+insert(struct cache* c, struct entry* e)
+{
+    struct entry** pe = lookup(c, e->e_dev, e->e_ino);
+
+    if(NULL != *pe)
+        unlink_entry(c, pe);
+    pe = &c->c_buckets[bucket(e->e_dev, e->e_ino)];
+    e->e_next = *pe;
+    *pe = e;
+    lru_push(c, e);
+    c->c_size += e->e_len;
+    ++c->c_len;
+
+    while(c->c_size > c->c_budget && c->c_oldest != e)
+    {
+        struct entry* old = c->c_oldest;
+        unlink_entry(c, lookup(c, old->e_dev, old->e_ino));
+        ++c->c_evicted;
+    }
+}
+
+static struct flight*
+flight_find(struct cache* c, const struct stat* st)
+{
+    struct flight* f = c->c_flights;
+
+    while(NULL != f && (f->f_dev != st->st_dev || f->f_ino != st->st_ino
+                || !samestamp(&f->f_mtim, &st->st_mtim)
+                || !samestamp(&f->f_ctim, &st->st_ctim)))
+        f = f->f_next;
+    return f;
+}
+
+static struct flight*
+flight_start(struct cache* c, const struct stat* st, int isstream)
+{
+    struct flight* f = malloc(sizeof(struct flight));
+
+    if(NULL == f)
+        return NULL;
+    f->f_dev = st->st_dev;
+    f->f_ino = st->st_ino;
+    f->f_mtim = st->st_mtim;
+    f->f_ctim = st->st_ctim;
+    f->f_refs = 1;
+    f->f_isdone = 0;
+    f->f_err = 0;
+    f->f_islinked = 1;
+    f->f_isstream = isstream;
+    f->f_parts = NULL;
+    f->f_tail = &f->f_parts;
+    f->f_size = 0;
+    f->f_result = NULL;
+    pthread_cond_init(&f->f_cond, NULL);
+    f->f_next = c->c_flights;
+    c->c_flights = f;
+    return f;
+}
+
+static void
+flight_drop_parts(struct flight* f)
+{
+    struct part* pt;
+
+    while(NULL != (pt = f->f_parts))
+    {
+        f->f_parts = pt->pt_next;
+        free(pt);
+    }
+    f->f_tail = &f->f_parts;
+}
+
+static void
+flight_put(struct flight* f)
+{
+    if(0 == --f->f_refs)
+    {
+        flight_drop_parts(f);
+        pthread_cond_destroy(&f->f_cond);
+        free(f);
+    }
+}
+
+/**
+ * Takes the flight out of the list, nobody joins it any more.
+ */
+static void
+flight_unlink(struct cache* c, struct flight* f)
+{
+    struct flight** pf = &c->c_flights;
+
+    if(!f->f_islinked)
+        return;
+    while(*pf != f)
+        pf = &(*pf)->f_next;
+    *pf = f->f_next;
+    f->f_islinked = 0;
+}
+
+/**
+ * Hands the result to the waiters, each of them gets a reference.
+ */
+static void
+flight_finish(struct cache* c, struct flight* f, struct entry* e, int err)
+{
+    flight_unlink(c, f);
+    if(NULL != e)
+        __sync_add_and_fetch(&e->e_refs, f->f_refs - 1);
+    f->f_result = e;
+    f->f_err = err;
+    f->f_isdone = 1;
+    pthread_cond_broadcast(&f->f_cond);
+    flight_put(f);
+}
+
+/**
+ * Keeps a part of a streamed listing for the followers. Past
+ * LISTING_REPLAY_MAX the flight takes no new ones, then the parts are
+ * kept only while somebody follows. Returns the number of waiters and
+ * followers or -1 if out of memory.
+ */
+static int
+flight_publish(struct cache* c, struct flight* f, const char* data,
+        size_t len)
+{
+    struct part* pt;
+
+    if(LISTING_REPLAY_MAX < f->f_size + len)
+        flight_unlink(c, f);
+    if(!f->f_islinked && 1 == f->f_refs)
+    {
+        flight_drop_parts(f); // nobody can replay them any more
+        return 0;
+    }
+
+    pt = malloc(sizeof(struct part) + len);
+    if(NULL == pt)
+        return -1;
+    pt->pt_next = NULL;
+    pt->pt_len = len;
+    memcpy(pt->pt_data, data, len);
+    *f->f_tail = pt;
+    f->f_tail = &pt->pt_next;
+    f->f_size += len;
+    pthread_cond_broadcast(&f->f_cond);
+    return f->f_refs - 1;
+}
+
+/* end of c_mx */
+
+/**
+ * Looks for a valid listing: a cached one or one being read by someone
+ * else. Returns 1 with *e or errno set if that settled it, 0 if the
+ * caller has to read the directory; then *f is its flight, if any.
+ * Nobody waits for a streamed read, it is paced by a client: a
+ * streaming caller gets 2 to follow *f, others read alone.
+ */
+static int
+cache_find(struct cache* c, const struct stat* st, struct entry** e,
+        struct flight** f, int isstream)
+{
+    int rv = 1;
+    int err = 0;
+    struct entry** pe;
+
+    *e = NULL;
+    *f = NULL;
+    pthread_mutex_lock(&c->c_mx);
+    pe = lookup(c, st->st_dev, st->st_ino);
+    if(NULL != *pe && samestamp(&(*pe)->e_mtim, &st->st_mtim)
+            && samestamp(&(*pe)->e_ctim, &st->st_ctim))
+    {
+        *e = *pe;
+        __sync_add_and_fetch(&(*e)->e_refs, 1);
+        lru_unlink(c, *e);
+        lru_push(c, *e);
+        ++c->c_hits;
+    }
+    else if(NULL != (*f = flight_find(c, st)))
+    {
+        if((*f)->f_isstream && !isstream)
+        {
+            ++c->c_misses;
+            pthread_mutex_unlock(&c->c_mx);
+            *f = NULL;
+            return 0;
+        }
+        ++(*f)->f_refs;
+        ++c->c_coalesced;
+        if((*f)->f_isstream)
+        {
+            pthread_mutex_unlock(&c->c_mx);
+            return 2;
+        }
+        while(!(*f)->f_isdone)
+            pthread_cond_wait(&(*f)->f_cond, &c->c_mx);
+        *e = (*f)->f_result;
+        err = (*f)->f_err;
+        // no result and no error: the reader was out of memory or
+        // streamed a listing too long to keep; ECANCELED: it stopped
+        if(ECANCELED == err)
+            err = 0;
+        rv = (NULL != *e || 0 != err);
+        flight_put(*f);
+        *f = NULL;
+    }
+    else
+    {
+        if(NULL != *pe)
+        {
+            unlink_entry(c, pe);
+            ++c->c_stale;
+        }
+        ++c->c_misses;
+        *f = flight_start(c, st, isstream);
+        rv = 0;
+    }
+    pthread_mutex_unlock(&c->c_mx);
+    errno = err;
+    return rv;
+}
+
+/**
+ * Copies the rendered listing into an entry, links it if it is worth
+ * keeping and gives it to the waiters. body is NULL if there is none:
+ * the read failed with err or a streamed listing was dropped. Returns
+ * the entry with a reference for the caller, NULL if only the arena has
+ * the listing.
+ */
+static struct entry*
+cache_add(struct cache* c, const struct stat* st, struct flight* f,
+        const struct iobuf* body, int err)
+{
+    struct entry* e = NULL;
+    size_t len = (NULL == body) ? 0 : iobuf_size(body);
+    int iskept = NULL != body && 0 < c->c_budget && len <= c->c_budget / 8
+        && !isracy(st);
+
+    if(NULL != body && (iskept || NULL != f))
+        e = malloc(sizeof(struct entry) + len);
+    if(NULL != e)
+    {
+        e->e_dev = st->st_dev;
+        e->e_ino = st->st_ino;
+        e->e_mtim = st->st_mtim;
+        e->e_ctim = st->st_ctim;
+        e->e_refs = 1;
+        e->e_len = len;
+        memcpy(e->e_data, body->b_data + body->b_off, len);
+    }
+
+    pthread_mutex_lock(&c->c_mx);
+    if(NULL != e && iskept)
+    {
+        __sync_add_and_fetch(&e->e_refs, 1);
+        insert(c, e);
+    }
+    if(NULL != f)
+        flight_finish(c, f, e, err);
+    pthread_mutex_unlock(&c->c_mx);
+    return e;
+}
+
+static void
+close_fd(void* arg)
+{
+    close(*(int*) arg);
+}
+
+/**
+ * The leader of a streamed read hands every part to the followers
+ * before its own sink. If the sink fails, the read goes on while
+ * somebody else needs it.
+ */
+static int
+lead_sink(void* arg, const char* data, size_t len)
+{
+    struct lead* ld = (struct lead*) arg;
+    int nothers;
+
+    pthread_mutex_lock(&g_cache.c_mx);
+    nothers = flight_publish(&g_cache, ld->ld_flight, data, len);
+    pthread_mutex_unlock(&g_cache.c_mx);
+    if(-1 == nothers)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(0 == ld->ld_err && -1 == ld->ld_sink(ld->ld_arg, data, len))
+        ld->ld_err = (0 != errno) ? errno : EIO;
+    if(0 != ld->ld_err && 0 == nothers)
+    {
+        errno = ld->ld_err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A leader cancelled in its sink leaves the followers without the rest.
+ */
+static void
+lead_cancel(void* arg)
+{
+    struct flight* f = ((struct lead*) arg)->ld_flight;
+
+    if(NULL == f)
+        return;
+    pthread_mutex_lock(&g_cache.c_mx);
+    flight_finish(&g_cache, f, NULL, ECANCELED);
+    pthread_mutex_unlock(&g_cache.c_mx);
+}
+
+static void
+follow_leave(void* arg)
+{
+    struct follow* fw = (struct follow*) arg;
+
+    if(!fw->fw_islocked)
+        pthread_mutex_lock(&g_cache.c_mx);
+    flight_put(fw->fw_flight);
+    pthread_mutex_unlock(&g_cache.c_mx);
+}
+
+/**
+ * Replays the parts of f rendered so far into the sink, then the rest
+ * as the leader renders it. Returns 0 or the error of the read.
+ */
+static int
+flight_follow(struct flight* f, listing_sink_t sink, void* arg,
+        int cancelstate)
+{
+    struct follow fw = {f, 1};
+    struct part* pt = NULL;
+    struct part* next;
+    int err = 0;
+
+    pthread_mutex_lock(&g_cache.c_mx);
+    pthread_cleanup_push(follow_leave, &fw);
+    pthread_setcancelstate(cancelstate, NULL);
+    while(0 == err)
+    {
+        next = (NULL == pt) ? f->f_parts : pt->pt_next;
+        if(NULL != next)
+        {
+            // the parts stay until the last reference to f is gone
+            fw.fw_islocked = 0;
+            pthread_mutex_unlock(&g_cache.c_mx);
+            if(-1 == sink(arg, next->pt_data, next->pt_len))
+                err = (0 != errno) ? errno : EIO;
+            pthread_mutex_lock(&g_cache.c_mx);
+            fw.fw_islocked = 1;
+            pt = next;
+        }
+        else if(f->f_isdone)
+        {
+            err = f->f_err;
+            break;
+        }
+        else
+        {
+            pthread_cond_wait(&f->f_cond, &g_cache.c_mx);
+        }
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_cleanup_pop(1);
+    return err;
+}
+
+/**
+ * Fills l with the listing of the directory. A cached one is used if
+ * the directory has not changed since, its stamps are checked on every
+ * call. Concurrent requests for a directory that has to be read share
+ * one read. Returns -1 with errno set on failure.
+ *
+ * With a sink, a directory that has to be read is streamed into it
+ * batch by batch instead and l->l_data is left NULL. Such a read is
+ * paced by the sink of its leader: others streaming the same listing
+ * follow it, the rest reads the directory alone.
+ */
+int
+listing_get(int fdcwd, const char* path, struct listing* l,
+        listing_sink_t sink, void* arg)
+{
+    int fd;
+    int rv;
+    int err = 0;
+    int ferr;
+    int state;
+    struct stat st;
+    struct arena* a;
+    struct entry* e;
+    struct flight* f;
+    struct lead ld;
+
+    l->l_data = NULL;
+    l->l_len = 0;
+    l->l_ref = NULL;
+
+    fd = openat(fdcwd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(-1 == fd)
+        return -1;
+    if(-1 == fstat(fd, &st))
+    {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    // others may wait for this thread, it must not be cancelled midway
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    rv = cache_find(&g_cache, &st, &e, &f, NULL != sink);
+    if(2 == rv)
+    {
+        err = flight_follow(f, sink, arg, state);
+    }
+    else if(0 == rv)
+    {
+        ld.ld_flight = f;
+        ld.ld_sink = sink;
+        ld.ld_arg = arg;
+        ld.ld_err = 0;
+        if(NULL != sink && NULL != f)
+        {
+            sink = lead_sink;
+            arg = &ld;
+        }
+
+        // a sink may block for long, the followers are told if it is
+        // cancelled there
+        pthread_cleanup_push(close_fd, &fd);
+        pthread_cleanup_push(lead_cancel, &ld);
+        if(NULL != sink)
+            pthread_setcancelstate(state, NULL);
+        a = arena_get();
+        rv = -1;
+        if(NULL == a)
+            err = ENOMEM;
+        else if(-1 == (rv = readdir_all(fd, a, sink, arg,
+                        (NULL != sink) ? g_cache.c_budget / 8 : (size_t) -1)))
+            err = errno;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_cleanup_pop(0);
+        pthread_cleanup_pop(0);
+
+        ferr = err;
+        if(0 != ld.ld_err)
+        {
+            // only the own sink failed, the others get what was read
+            ferr = (-1 == rv) ? ECANCELED : 0;
+            err = ld.ld_err;
+        }
+        e = cache_add(&g_cache, &st, f,
+                (ferr || 1 == rv) ? NULL : &a->a_body, ferr);
+        if(NULL != sink)
+        {
+            if(NULL != e)
+                entry_put(e);
+            e = NULL;
+        }
+        else if(NULL == e && 0 == err)
+        {
+            l->l_data = a->a_body.b_data + a->a_body.b_off;
+            l->l_len = iobuf_size(&a->a_body);
+        }
+    }
+    else if(NULL == e)
+    {
+        err = errno;
+    }
+    pthread_setcancelstate(state, NULL);
+    close(fd);
+
+    if(NULL != e)
+    {
+        l->l_data = e->e_data;
+        l->l_len = e->e_len;
+        l->l_ref = e;
+    }
+    errno = err;
+    return (0 == err) ? 0 : -1;
+}
+
+void
+listing_put(struct listing* l)
+{
+    if(NULL != l->l_ref)
+        entry_put((struct entry*) l->l_ref);
+    l->l_ref = NULL;
+}
+
+/**
+ * This function uses printf(), because it is called on a request
+ * from the <terminal> module.
+ */
+void
+listing_printinfo()
+{
+    int state;
+    struct cache* c = &g_cache;
+    unsigned long lookups;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&c->c_mx);
+    lookups = c->c_hits + c->c_misses + c->c_coalesced;
+    printf("LS cache: %zu listings, %zu of %zu bytes\n"
+            "\tHits: %lu of %lu (%lu%%)\n"
+            "\tStale: %lu, evicted: %lu, reads shared: %lu\n",
+            c->c_len, c->c_size, c->c_budget,
+            c->c_hits, lookups, (0 < lookups) ? 100 * c->c_hits / lookups : 0,
+            c->c_stale, c->c_evicted, c->c_coalesced);
+    pthread_mutex_unlock(&c->c_mx);
+    pthread_setcancelstate(state, NULL);
+}
+
+/**
+ * cachesize is the budget of the cache in bytes, 0 turns it off.
+ */
+int
+listing_init(long cachesize)
+{
+    memset(&g_cache, 0, sizeof(g_cache));
+    g_cache.c_budget = cachesize;
+    pthread_mutex_init(&g_cache.c_mx, NULL);
+
+    if(0 != pthread_key_create(&g_key, arena_free))
+    {
+        logger_error("[listing] pthread_key_create failed\n");
+        return -1;
+    }
+    logger_info("[listing] the cache budget is %ld bytes\n", cachesize);
+    return 0;
+}
+
+void
+listing_destroy()
+{
+    int i;
+    struct arena* a = pthread_getspecific(g_key);
+
+    if(NULL != a)
+        arena_free(a);
+    pthread_key_delete(g_key);
+
+    for(i = 0; i < LISTING_BUCKETS; ++i)
+    {
+        while(NULL != g_cache.c_buckets[i])
+            unlink_entry(&g_cache, &g_cache.c_buckets[i]);
+    }
+    pthread_mutex_destroy(&g_cache.c_mx);
+}
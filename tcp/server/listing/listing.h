@@ -0,0 +1,47 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stddef.h>
+
+#define LISTING_DENTS_SIZE (64 * 1024)
+#define LISTING_BODY_SIZE 1024
+#define LISTING_KEEP_MAX (1024 * 1024) // a bigger arena is shrunk back
+#define LISTING_CACHE_SIZE (16 * 1024 * 1024) // the default budget
+#define LISTING_BUCKETS 1024
+#define LISTING_RACY_MS 1000 // a younger directory is not cached
+#define LISTING_REPLAY_MAX (1024 * 1024) // no followers join past it
+
+/**
+ * A rendered listing. It stays valid until listing_put(), whether it
+ * lives in the shared cache or in the thread's arena.
+ */
+struct listing
+{
+    const char* l_data;
+    size_t l_len;
+    void* l_ref; // the cache entry, NULL for the arena
+};
+
+int
+listing_init(long cachesize);
+
+void
+listing_destroy();
+
+/**
+ * Takes the next rendered part of a listing being read, returns -1 to
+ * stop the read.
+ */
+typedef int (*listing_sink_t)(void* arg, const char* data, size_t len);
+
+int
+listing_get(int fdcwd, const char* path, struct listing* l,
+        listing_sink_t sink, void* arg);
+
+void
+listing_put(struct listing* l);
+
+void
+listing_printinfo();
+
+#endif
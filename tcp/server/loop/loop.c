@@ -0,0 +1,428 @@
+#include "lib/termproto.h"
+#include "logger/logger.h"
+#include "server/handler/handler.h"
+#include "server/loop/loop.h"
+#include "server/pool/pool.h"
+#include "server/service/service.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_LOOP
+#define LOOP_MAX_EVENTS 64
+#define LOOP_READ_SIZE 4096
+#define LOOP_READ_MAX (16 * TERMPROTO_BUF_SIZE) // read in one wakeup
+#define LOOP_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+
+struct loop
+{
+    int lp_epfd;
+    int lp_evfd;
+    pthread_t lp_tid;
+};
+
+static struct loop* g_loops;
+static int g_loopslen;
+static unsigned int g_next;
+static int g_isrunning;
+static int g_ispooled;
+
+static int
+setnonblocking(int sfd)
+{
+    int flags = fcntl(sfd, F_GETFL, 0);
+    if(-1 == flags)
+        return -1;
+    return fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Where a peer stands after a wakeup, it decides how to arm it again.
+ */
+enum loop_state
+{
+    LOOP_GONE, // the peer failed
+    LOOP_EOF, // the peer hung up, its answers are sent first
+    LOOP_IDLE, // the socket is drained
+    LOOP_MORE, // the socket may have more to read
+    LOOP_STALLED // p_out is above PEER_OUT_HIGH, it waits for EPOLLOUT
+};
+
+/**
+ * Reads once, up to LOOP_READ_SIZE bytes and what is left of the budget
+ * of this wakeup. The requests read are answered before the next read,
+ * so p_in does not have to grow. Only EAGAIN tells that the socket is
+ * drained: a short read may be followed by a FIN that brings no new
+ * edge.
+ */
+static int
+loop_read(struct peer* p, size_t* budget)
+{
+    ssize_t rc;
+    size_t n = (LOOP_READ_SIZE < *budget) ? LOOP_READ_SIZE : *budget;
+    struct iobuf* in = &p->p_in;
+
+    if(-1 == iobuf_reserve(in, n))
+        return LOOP_GONE;
+    do
+    {
+        rc = recv(p->p_sfd, in->b_data + in->b_len, n, 0);
+    } while(-1 == rc && EINTR == errno);
+
+    if(0 < rc)
+    {
+        in->b_len += rc;
+        *budget -= rc;
+        return LOOP_MORE;
+    }
+    if(0 == rc)
+    {
+        logger_info("[loop] peer #%u hung up\n", p->p_id);
+        return LOOP_EOF;
+    }
+    if(EAGAIN == errno || EWOULDBLOCK == errno)
+        return LOOP_IDLE;
+    logger_warn("[loop] recv: %s\n", strerror(errno));
+    return LOOP_GONE;
+}
+
+/**
+ * Handles the complete requests in the input buffer one by one until
+ * the answers reach PEER_OUT_HIGH. Returns -1 if the peer has to be
+ * disconnected.
+ */
+static int
+loop_process(struct peer* p)
+{
+    int rv;
+
+    while(0 == p->p_isclosing && iobuf_size(&p->p_out) < PEER_OUT_HIGH)
+    {
+        rv = service_next(p);
+        if(-1 == rv)
+            return -1;
+        if(0 == rv)
+            break;
+        if(2 == rv)
+            p->p_isclosing = 1;
+    }
+    return 0;
+}
+
+/**
+ * Sends queued responses until EAGAIN.
+ * Returns 0 if everything was sent, 1 if the socket is full, -1 on error.
+ */
+static int
+loop_flush(struct peer* p)
+{
+    ssize_t rc;
+    struct iobuf* out = &p->p_out;
+
+    while(0 < iobuf_size(out))
+    {
+        rc = send(p->p_sfd, out->b_data + out->b_off, iobuf_size(out),
+                MSG_NOSIGNAL);
+        if(0 <= rc)
+        {
+            iobuf_consume(out, rc);
+        }
+        else if(EAGAIN == errno || EWOULDBLOCK == errno)
+        {
+            return 1;
+        }
+        else if(EINTR != errno)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+loop_release(struct peer* p)
+{
+    struct loop* lp = (struct loop*) p->p_loop;
+    epoll_ctl(lp->lp_epfd, EPOLL_CTL_DEL, p->p_sfd, NULL);
+    handler_release(p);
+}
+
+/**
+ * With the pool a peer is registered as EPOLLONESHOT, so exactly one
+ * thread (a loop or a worker) owns it until it is armed again. A peer
+ * that waits for its answers to go out is armed for EPOLLOUT only, so
+ * it reads nothing more until then. Without the pool arming it again
+ * only queues a peer that has more to read behind the others.
+ */
+static void
+loop_rearm(struct peer* p, int state)
+{
+    struct epoll_event ev;
+    struct loop* lp = (struct loop*) p->p_loop;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = LOOP_EVENTS | EPOLLONESHOT;
+    if(!g_ispooled)
+        ev.events = LOOP_EVENTS | EPOLLOUT;
+    else if(LOOP_STALLED == state || p->p_isclosing)
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+    else if(0 < iobuf_size(&p->p_out))
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = p;
+    if(-1 == epoll_ctl(lp->lp_epfd, EPOLL_CTL_MOD, p->p_sfd, &ev))
+        logger_error("[loop] epoll_ctl: %s\n", strerror(errno));
+}
+
+static void
+loop_finish(struct peer* p, int state)
+{
+    // a peer that hung up leaves as after LOGOUT, once p_out is sent
+    if(LOOP_EOF == state)
+        p->p_isclosing = 1;
+    if(LOOP_GONE == state
+            || (p->p_isclosing && 0 == iobuf_size(&p->p_out)))
+    {
+        loop_release(p);
+        return;
+    }
+
+    // a burst is over, its buffers are not kept for the whole session
+    if(0 == iobuf_size(&p->p_in))
+        iobuf_shrink(&p->p_in, LOOP_READ_SIZE);
+    if(0 == iobuf_size(&p->p_out))
+        iobuf_shrink(&p->p_out, TERMPROTO_BUF_SIZE);
+    if(g_ispooled || LOOP_MORE == state)
+        loop_rearm(p, state);
+}
+
+/**
+ * Answers what is buffered, then reads more, but only while the answers
+ * go out: once p_out stays above PEER_OUT_HIGH the peer is left until
+ * EPOLLOUT, a client that does not read cannot make it grow. Reads take
+ * turns with answering and stop at LOOP_READ_MAX, then the peer is
+ * queued again. On a loop with the pool the requests are passed to it,
+ * unless its queue is full.
+ */
+static void
+loop_serve(struct peer* p, int isworker)
+{
+    int state = LOOP_MORE;
+    size_t budget = LOOP_READ_MAX;
+    int cansubmit = g_ispooled && !isworker;
+
+    // the peer has one owner at a time, see loop_rearm()
+    p->p_isworker = isworker;
+
+    while(1)
+    {
+        if(0 > loop_flush(p))
+        {
+            logger_warn("[loop] send: %s\n", strerror(errno));
+            state = LOOP_GONE;
+            break;
+        }
+        if(PEER_OUT_HIGH <= iobuf_size(&p->p_out))
+        {
+            state = LOOP_STALLED;
+            break;
+        }
+        if(p->p_isclosing)
+            break;
+        if(peer_haspending(p))
+        {
+            if(cansubmit && 0 == pool_submit(p))
+                return;
+            if(-1 == loop_process(p))
+            {
+                state = LOOP_GONE;
+                break;
+            }
+            continue;
+        }
+        if(LOOP_MORE != state || 0 == budget)
+            break;
+        state = loop_read(p, &budget);
+        if(LOOP_GONE == state)
+            break;
+    }
+
+    loop_finish(p, state);
+}
+
+static void
+loop_work(void* arg)
+{
+    loop_serve((struct peer*) arg, 1);
+}
+
+static void*
+loop_run(void* arg)
+{
+    int i, n;
+    struct loop* lp = (struct loop*) arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    logger_info("[loop] started: epfd=%d\n", lp->lp_epfd);
+    while(__sync_fetch_and_or(&g_isrunning, 0))
+    {
+        n = epoll_wait(lp->lp_epfd, events, LOOP_MAX_EVENTS, -1);
+        if(-1 == n)
+        {
+            if(EINTR == errno)
+                continue;
+            logger_error("[loop] epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+
+        for(i = 0; i < n; ++i)
+        {
+            if(NULL == events[i].data.ptr)
+                continue; // woken up by loop_destroy()
+            loop_serve(events[i].data.ptr, 0);
+        }
+    }
+
+    return NULL;
+}
+
+int
+loop_init(int nloops, int nworkers)
+{
+    int i;
+    struct epoll_event ev;
+
+    if(0 < nworkers)
+    {
+        if(-1 == pool_init(nworkers, loop_work))
+            return -1;
+        g_ispooled = 1;
+    }
+
+    logger_info("[loop] initializing %d loops...\n", nloops);
+    g_loops = malloc(nloops * sizeof(struct loop));
+    if(NULL == g_loops)
+    {
+        loop_destroy(); // the pool
+        return -1;
+    }
+    memset(g_loops, 0, nloops * sizeof(struct loop));
+
+    __sync_fetch_and_or(&g_isrunning, 1);
+    for(i = 0; i < nloops; ++i)
+    {
+        struct loop* lp = &g_loops[i];
+
+        lp->lp_epfd = epoll_create1(EPOLL_CLOEXEC);
+        lp->lp_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(-1 == lp->lp_epfd || -1 == lp->lp_evfd
+                || -1 == epoll_ctl(lp->lp_epfd, EPOLL_CTL_ADD, lp->lp_evfd, &ev)
+                || 0 != pthread_create(&lp->lp_tid, NULL, loop_run, lp))
+        {
+            logger_error("[loop] loop #%d: %s\n", i, strerror(errno));
+            if(-1 != lp->lp_epfd)
+                close(lp->lp_epfd);
+            if(-1 != lp->lp_evfd)
+                close(lp->lp_evfd);
+            break;
+        }
+        ++g_loopslen;
+    }
+
+    if(g_loopslen != nloops)
+    {
+        loop_destroy();
+        return -1;
+    }
+    return 0;
+}
+
+void
+loop_destroy()
+{
+    int i;
+    uint64_t one = 1;
+
+    logger_info("[loop] destroying...\n");
+    __sync_fetch_and_and(&g_isrunning, 0);
+    for(i = 0; i < g_loopslen; ++i)
+    {
+        if(-1 == write(g_loops[i].lp_evfd, &one, sizeof(one)))
+            logger_error("[loop] write: %s\n", strerror(errno));
+        pthread_join(g_loops[i].lp_tid, NULL);
+    }
+    if(g_ispooled)
+    {
+        pool_destroy();
+        g_ispooled = 0;
+    }
+    for(i = 0; i < g_loopslen; ++i)
+    {
+        close(g_loops[i].lp_epfd);
+        close(g_loops[i].lp_evfd);
+    }
+    free(g_loops);
+    g_loops = NULL;
+    g_loopslen = 0;
+}
+
+int
+loop_isrunning()
+{
+    return __sync_fetch_and_or(&g_isrunning, 0);
+}
+
+int
+loop_add(struct peer* p)
+{
+    struct epoll_event ev;
+    struct loop* lp = &g_loops[__sync_fetch_and_add(&g_next, 1) % g_loopslen];
+
+    if(-1 == setnonblocking(p->p_sfd))
+    {
+        logger_error("[loop] fcntl: %s\n", strerror(errno));
+        return -1;
+    }
+
+    p->p_buflen = TERMPROTO_BUF_SIZE;
+    p->p_buffer = malloc(p->p_buflen);
+    if(NULL == p->p_buffer
+            || -1 == iobuf_init(&p->p_in, LOOP_READ_SIZE)
+            || -1 == iobuf_init(&p->p_out, TERMPROTO_BUF_SIZE))
+    {
+        logger_error("[loop] malloc failed: %s\n", strerror(errno));
+        return -1;
+    }
+    p->p_loop = lp;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = LOOP_EVENTS | (g_ispooled ? EPOLLONESHOT : EPOLLOUT);
+    ev.data.ptr = p;
+    if(-1 == epoll_ctl(lp->lp_epfd, EPOLL_CTL_ADD, p->p_sfd, &ev))
+    {
+        logger_error("[loop] epoll_ctl: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * The loop owns its peers, so other threads only shut the socket down.
+ * The loop notices it and releases the peer itself.
+ */
+void
+loop_kill(struct peer* p)
+{
+    shutdown(p->p_sfd, SHUT_RDWR);
+}
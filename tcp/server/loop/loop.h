@@ -0,0 +1,21 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "server/handler/peer/peer.h"
+
+int
+loop_init(int nloops, int nworkers);
+
+void
+loop_destroy();
+
+int
+loop_isrunning();
+
+int
+loop_add(struct peer* p);
+
+void
+loop_kill(struct peer* p);
+
+#endif
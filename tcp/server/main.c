@@ -2,31 +2,149 @@
 #include "../server/server.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_MAIN
+
+static void
+print_usage(const char* name)
+{
+    printf("Usage: %s [-e loops] [-w workers] [-c peers]"
+           " [-q pending] [-t ms] [-m kbytes] [-r dir] [-l policy]"
+           " [-f format] [-o file] [-s kbytes] [-p seconds] [-y ms]"
+           " host port\n"
+           "\t-e loops\tdrive peers by <loops> epoll threads"
+           " instead of a thread per peer\n"
+           "\t-w workers\tdo requests in a pool of <workers> threads\n"
+           "\t-c peers\tserve up to <peers> peers at once\n"
+           "\t-q pending\tlet up to <pending> peers wait for a free slot\n"
+           "\t-t ms\t\treject a waiting peer after <ms>\n"
+           "\t-m kbytes\tcache up to <kbytes> of LS listings, 0 for none\n"
+           "\t-r dir\t\tkeep peers beneath <dir>, it is their \"/\"\n"
+           "\t-l policy\twhen the log is full: drop (the default) or block\n"
+           "\t-f format\tlog as text (the default), deferred to format"
+           " the text in the writer or binary for logdecode\n"
+           "\t-o file\t\tlog to <file> instead of stderr\n"
+           "\t-s kbytes\trotate the log file once it has <kbytes>\n"
+           "\t-p seconds\trotate the log file after <seconds>\n"
+           "\t-y ms\t\tfdatasync the log every <ms>\n",
+           name);
+}
 
 int
 main(int argc, char** argv)
 {
-    if(3 != argc)
+    int opt;
+    int rv = 1;
+    struct handler_opts opts;
+    struct logger_opts lopts;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&lopts, 0, sizeof(lopts));
+    opts.ho_wait = -1;
+    opts.ho_cache = -1;
+    while(-1 != (opt = getopt(argc, argv, "e:w:c:q:t:m:r:l:f:o:s:p:y:")))
     {
-        printf("Usage: %s host port\n", argv[0]);
+        switch(opt)
+        {
+            case 'e':
+                opts.ho_loops = atoi(optarg);
+                break;
+            case 'w':
+                opts.ho_workers = atoi(optarg);
+                break;
+            case 'c':
+                opts.ho_capacity = atoi(optarg);
+                break;
+            case 'q':
+                opts.ho_pending = atoi(optarg);
+                break;
+            case 't':
+                opts.ho_wait = atoi(optarg);
+                break;
+            case 'm':
+                opts.ho_cache = atoi(optarg);
+                break;
+            case 'r':
+                opts.ho_root = optarg;
+                break;
+            case 'l':
+                if(0 == strcmp(optarg, "block"))
+                    lopts.lo_policy = LOGGER_BLOCK;
+                else if(0 == strcmp(optarg, "drop"))
+                    lopts.lo_policy = LOGGER_DROP;
+                else
+                    lopts.lo_policy = -1;
+                break;
+            case 'f':
+                if(0 == strcmp(optarg, "text"))
+                    lopts.lo_format = LOGGER_TEXT;
+                else if(0 == strcmp(optarg, "deferred"))
+                    lopts.lo_format = LOGGER_DEFERRED;
+                else if(0 == strcmp(optarg, "binary"))
+                    lopts.lo_format = LOGGER_BINARY;
+                else
+                    lopts.lo_format = -1;
+                break;
+            case 'o':
+                lopts.lo_path = optarg;
+                break;
+            case 's':
+                lopts.lo_maxsize = atol(optarg) * 1024;
+                break;
+            case 'p':
+                lopts.lo_period = atol(optarg) * 1000;
+                break;
+            case 'y':
+                lopts.lo_sync = atol(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(2 != argc - optind || 0 > opts.ho_loops
+            || 0 > opts.ho_workers || 0 > opts.ho_capacity
+            || 0 > opts.ho_pending || 0 > lopts.lo_policy
+            || 0 > lopts.lo_format || 0 > lopts.lo_maxsize
+            || 0 > lopts.lo_period || 0 > lopts.lo_sync
+            || (NULL == lopts.lo_path
+                && (0 < lopts.lo_maxsize || 0 < lopts.lo_period)))
+    {
+        print_usage(argv[0]);
         return 1;
     }
 
-    logger_init();
+    if(-1 == logger_init(&lopts))
+    {
+        perror(lopts.lo_path);
+        return 1;
+    }
 
-    if(-1 != server_prepare(argv[1], argv[2]))
+    if(-1 != server_prepare(argv[optind], argv[optind + 1]))
     {
-        logger_log("[main] starting the server...\n");
-        server_run();
-        server_join();
+        logger_info("[main] starting the server...\n");
+        if(0 == server_run(&opts))
+        {
+            server_join();
+            rv = 0;
+        }
+        else
+        {
+            // the handler has taken apart what it had set up
+            server_stop();
+        }
     }
     else
     {
-        logger_log("[main] server has not started\n");
+        logger_error("[main] server has not started\n");
     }
 
-    logger_log("[main] server has shut down\n");
+    logger_info("[main] server has shut down\n");
     logger_destroy();
 
-    return 0;
+    return rv;
 }
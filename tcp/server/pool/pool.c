@@ -0,0 +1,146 @@
+#include "logger/logger.h"
+#include "server/pool/pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_POOL
+#define POOL_QUEUE_FACTOR 64
+
+struct pool
+{
+    int pl_isrunning;
+    int pl_workerslen;
+    pthread_t* pl_workers;
+    void (*pl_work)(void* arg);
+
+    /* a ring of submitted arguments */
+    void** pl_queue;
+    size_t pl_qcap;
+    size_t pl_qhead;
+    size_t pl_qlen;
+    pthread_mutex_t pl_mx;
+    pthread_cond_t pl_cv;
+};
+
+static struct pool g_pool;
+
+static void*
+pool_worker(void* arg)
+{
+    struct pool* pl = (struct pool*) arg;
+    void* task;
+
+    while(1)
+    {
+        pthread_mutex_lock(&pl->pl_mx);
+        while(0 == pl->pl_qlen && pl->pl_isrunning)
+        {
+            pthread_cond_wait(&pl->pl_cv, &pl->pl_mx);
+        }
+        if(0 == pl->pl_qlen)
+        {
+            // stopped and drained
+            pthread_mutex_unlock(&pl->pl_mx);
+            break;
+        }
+        task = pl->pl_queue[pl->pl_qhead];
+        pl->pl_qhead = (pl->pl_qhead + 1) % pl->pl_qcap;
+        --pl->pl_qlen;
+        pthread_mutex_unlock(&pl->pl_mx);
+
+        pl->pl_work(task);
+    }
+
+    return NULL;
+}
+
+int
+pool_init(int nworkers, void (*work)(void* arg))
+{
+    int i;
+    struct pool* pl = &g_pool;
+
+    logger_info("[pool] initializing %d workers...\n", nworkers);
+    pl->pl_work = work;
+    pl->pl_qcap = POOL_QUEUE_FACTOR * nworkers;
+    pl->pl_qhead = 0;
+    pl->pl_qlen = 0;
+    pl->pl_queue = malloc(pl->pl_qcap * sizeof(void*));
+    pl->pl_workers = malloc(nworkers * sizeof(pthread_t));
+    if(NULL == pl->pl_queue || NULL == pl->pl_workers)
+    {
+        free(pl->pl_queue);
+        free(pl->pl_workers);
+        return -1;
+    }
+    pthread_mutex_init(&pl->pl_mx, NULL);
+    pthread_cond_init(&pl->pl_cv, NULL);
+
+    pl->pl_isrunning = 1;
+    pl->pl_workerslen = 0;
+    for(i = 0; i < nworkers; ++i)
+    {
+        if(0 != pthread_create(&pl->pl_workers[i], NULL, pool_worker, pl))
+        {
+            logger_error("[pool] pthread_create: %s\n", strerror(errno));
+            pool_destroy();
+            return -1;
+        }
+        ++pl->pl_workerslen;
+    }
+    return 0;
+}
+
+/**
+ * Waits for the queued tasks to be done and joins the workers.
+ */
+void
+pool_destroy()
+{
+    int i;
+    struct pool* pl = &g_pool;
+
+    if(NULL == pl->pl_workers)
+        return;
+
+    logger_info("[pool] destroying...\n");
+    pthread_mutex_lock(&pl->pl_mx);
+    pl->pl_isrunning = 0;
+    pthread_cond_broadcast(&pl->pl_cv);
+    pthread_mutex_unlock(&pl->pl_mx);
+
+    for(i = 0; i < pl->pl_workerslen; ++i)
+    {
+        pthread_join(pl->pl_workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pl->pl_mx);
+    pthread_cond_destroy(&pl->pl_cv);
+    free(pl->pl_queue);
+    free(pl->pl_workers);
+    memset(pl, 0, sizeof(struct pool));
+}
+
+/**
+ * Returns -1 if the queue is full, so the caller may do the work itself.
+ */
+int
+pool_submit(void* arg)
+{
+    int rv = -1;
+    struct pool* pl = &g_pool;
+
+    pthread_mutex_lock(&pl->pl_mx);
+    if(pl->pl_isrunning && pl->pl_qlen < pl->pl_qcap)
+    {
+        pl->pl_queue[(pl->pl_qhead + pl->pl_qlen) % pl->pl_qcap] = arg;
+        ++pl->pl_qlen;
+        pthread_cond_signal(&pl->pl_cv);
+        rv = 0;
+    }
+    pthread_mutex_unlock(&pl->pl_mx);
+    return rv;
+}
@@ -0,0 +1,13 @@
+#ifndef POOL_H
+#define POOL_H
+
+int
+pool_init(int nworkers, void (*work)(void* arg));
+
+void
+pool_destroy();
+
+int
+pool_submit(void* arg);
+
+#endif
@@ -4,7 +4,9 @@
 #include "server/terminal/terminal.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,7 +14,9 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#define SERVER_BACKLOG 5
+#define LOGGER_CATEGORY LOGGER_CAT_SERVER
+#define SERVER_BACKLOG SOMAXCONN
+#define SERVER_PAUSE_TIME 100 // ms
 
 struct serverdata
 {
@@ -20,6 +24,7 @@ struct serverdata
     const char* port;
     int isrunning;
     int listensocket;
+    int reservedfd; // is given up to shed a peer when out of descriptors
     pthread_t accept_tid;
 };
 
@@ -41,7 +46,7 @@ trybind(struct addrinfo* servinfo)
 
         if(-1 == setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
         {
-            logger_log("[server] setsockopt: %s\n", strerror(errno));
+            logger_error("[server] setsockopt: %s\n", strerror(errno));
             return -1;
         }
 
@@ -55,7 +60,7 @@ trybind(struct addrinfo* servinfo)
 
     if(NULL == p)
     {
-        logger_log("[server] Could not bind: %s\n", strerror(errno));
+        logger_error("[server] Could not bind: %s\n", strerror(errno));
         return -1;
     }
 
@@ -81,7 +86,7 @@ server_prepare(const char* host, const char* port)
     rv = getaddrinfo(this.host, this.port, &hints, &servinfo);
     if(0 != rv)
     {
-        logger_log("[server] getaddrinfo: %s\n", gai_strerror(rv));
+        logger_error("[server] getaddrinfo: %s\n", gai_strerror(rv));
         return -1;
     }
 
@@ -91,59 +96,108 @@ server_prepare(const char* host, const char* port)
     {
         if(-1 == listen(rv, SERVER_BACKLOG))
         {
-            logger_log("[server] listen: %s\n", strerror(errno));
+            logger_error("[server] listen: %s\n", strerror(errno));
             return -1;
         }
         this.listensocket = rv;
+        this.reservedfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     }
 
     return rv;
 }
 
+/**
+ * Closes the reserved descriptor for a while to accept
+ * and reject the oldest connection in the backlog.
+ */
+static void
+shedpeer(int master)
+{
+    int slave;
+
+    close(this.reservedfd);
+    slave = accept(master, NULL, NULL);
+    if(-1 != slave)
+    {
+        logger_warn("[server] out of descriptors, rejecting %d\n", slave);
+        peer_reject(slave);
+    }
+    this.reservedfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
 static void*
 server_acceptloop()
 {
+    int rv;
     int slave;
     int master = this.listensocket;
+    int ispaused = 0;
+    struct pollfd pfd;
     struct sockaddr_storage sa_peer;
     socklen_t addrsize = sizeof(sa_peer);
 
     __sync_fetch_and_or(&this.isrunning, 1);
     while(1)
     {
+        pfd.fd = master;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if(ispaused)
+        {
+            // let the peers give some descriptors back
+            poll(NULL, 0, SERVER_PAUSE_TIME);
+            ispaused = 0;
+        }
+        rv = poll(&pfd, 1, handler_expire());
+
+        if(!__sync_and_and_fetch(&this.isrunning, 1))
+        {
+            break;
+        }
+        else if(0 >= rv)
+        {
+            continue;
+        }
+
+        addrsize = sizeof(sa_peer);
         slave = accept(master, (struct sockaddr*) &sa_peer, &addrsize);
         if(-1 != slave)
         {
-            logger_log("[server] new peer: %d\n", slave);
-            handler_new(slave);
+            logger_info("[server] new peer: %d\n", slave);
+            handler_new(slave, &sa_peer);
         }
-        else
+        else if(EMFILE == errno || ENFILE == errno)
         {
-            if(!__sync_and_and_fetch(&this.isrunning, 1))
-            {
-                break;
-            }
-            else if(EINTR != errno)
-            {
-                logger_log("[server] accept(): %s\n", strerror(errno));
-                return NULL;
-            }
+            shedpeer(master);
+            ispaused = 1;
+        }
+        else if(EINTR != errno && ECONNABORTED != errno
+                && EAGAIN != errno && ENOBUFS != errno && ENOMEM != errno)
+        {
+            logger_error("[server] accept(): %s\n", strerror(errno));
+            return NULL;
         }
     }
 
     return NULL;
 }
 
-void
-server_run()
+int
+server_run(const struct handler_opts* opts)
 {
-    handler_init();
+    if(-1 == handler_init(opts))
+    {
+        logger_error("[server] handler_init failed\n");
+        return -1;
+    }
 
     pthread_create(&this.accept_tid, NULL,
             server_acceptloop, &this.listensocket);
 
     terminal_setstopservercb(&server_stop);
     terminal_run();
+    return 0;
 }
 
 void
@@ -152,6 +206,7 @@ server_stop()
     __sync_fetch_and_and(&this.isrunning, 0);
     shutdown(this.listensocket, SHUT_RDWR);
     close(this.listensocket);
+    close(this.reservedfd);
 }
 
 void
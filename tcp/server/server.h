@@ -1,11 +1,13 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "server/handler/handler.h"
+
 int
 server_prepare(const char* host, const char* port);
 
-void
-server_run();
+int
+server_run(const struct handler_opts* opts);
 
 void
 server_stop();
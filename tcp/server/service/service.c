@@ -1,12 +1,16 @@
 #include "lib/efunc.h"
+#include "lib/iobuf.h"
 #include "lib/termproto.h"
 #include "logger/logger.h"
+#include "server/accounts/accounts.h"
 #include "server/handler/handler.h"
+#include "server/listing/listing.h"
 #include "server/service/service.h"
+#include "server/who/who.h"
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,48 +18,119 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#define LOGGER_CATEGORY LOGGER_CAT_SERVICE
 #define DEFAULT_PATH "/"
-#define DB_ACCOUNTS "/tmp/accounts"
 
 static const char * const MSG_EMPTY = "";
 static const char * const AUTH_MULTIPLE = "You\'ve been authorised";
 static const char * const AUTH_BAD_TRY = "Unable to log in";
 static const char * const AUTH_GRANTED = "Successful authentication";
 
+/**
+ * Writes the header in the framing the peer agreed on.
+ */
+static size_t
+put_header(struct peer* p, char* buf, size_t bufsize,
+        enum TERM_STATUS status, msgsize_t size, int flags)
+{
+    if(TERM_PROTO_BIN == p->p_proto)
+        return term_put_bin_header(buf, bufsize, p->p_reqid, status, size,
+                flags);
+    return term_put_header(buf, bufsize, p->p_proto, status, size, flags);
+}
+
+/**
+ * The deflate stream cannot go on after a failure, the session falls
+ * back to plain bodies.
+ */
+static int
+deflate_body(struct peer* p, const struct iovec* body, int bodycnt,
+        struct iovec* out)
+{
+    if(0 == compress_iov(p->p_zip, body, bodycnt, out))
+        return 0;
+    logger_warn("[service] peer #%u: deflate failed\n", p->p_id);
+    compress_free(p->p_zip);
+    p->p_zip = NULL;
+    return -1;
+}
+
+static size_t
+put_chunk(struct peer* p, char* buf, size_t bufsize, msgsize_t size)
+{
+    if(TERM_PROTO_BIN == p->p_proto)
+        return term_put_bin_chunk(buf, bufsize, size);
+    return term_put_chunk(buf, bufsize, size);
+}
+
 static void
-error_term(int sfd, struct term_req* req)
+error_term(struct peer* p, struct term_req* req)
 {
     size_t rs = 32;
     char resp[rs];
     size_t size;
 
-    size = term_put_header(resp, rs, req->status, 0);
+    size = put_header(p, resp, rs, req->status, 0, 0);
 
-    sendall(sfd, resp, &size);
+    peer_send(p, resp, size);
 }
 
+/**
+ * The header and the body segments are handed over as they are,
+ * peer_sendv() decides whether to copy them or to write them out.
+ */
 static void
-small_resp(struct peer* p, struct term_req* req)
+send_resp(struct peer* p, enum TERM_STATUS status, struct iovec* body,
+        int bodycnt)
 {
-    size_t respsize;
-    msgsize_t bodylen = strlen(req->msg);
-    bodylen += (bodylen != 0) ? 2 : 0;
-
-    respsize = term_put_header(p->p_buffer, p->p_buflen, req->status,
-            bodylen);
-    if(MSG_EMPTY != req->msg)
-        respsize += sprintf(p->p_buffer + respsize, "%s\r\n", req->msg);
-    sendall(p->p_sfd, p->p_buffer, &respsize);
+    int i;
+    int flags = 0;
+    char header[64];
+    msgsize_t bodylen = 0;
+    struct iovec iov[PEER_IOV_MAX];
+
+    for(i = 0; i < bodycnt; ++i)
+    {
+        bodylen += body[i].iov_len;
+        iov[i + 1] = body[i];
+    }
+    if(NULL != p->p_zip && COMPRESS_MIN <= bodylen
+            && 0 == deflate_body(p, body, bodycnt, iov + 1))
+    {
+        bodycnt = 1;
+        bodylen = iov[1].iov_len;
+        flags = TERM_F_DEFLATE;
+    }
+    if(TERM_PROTO_2 > p->p_proto && TERM_PROTO_1_MAX < bodylen)
+    {
+        // the length would wrap, the client could not find the next header
+        logger_debug("[service] peer #%u: %llu bytes need PROTO 2\n",
+                p->p_id, bodylen);
+        status = INTERNAL_ERROR;
+        bodycnt = 0;
+        bodylen = 0;
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = put_header(p, header, sizeof(header), status, bodylen,
+            flags);
+    peer_sendv(p, iov, bodycnt + 1);
 }
 
-static char*
-get_username(struct peer* p, char* login)
+static void
+small_resp(struct peer* p, struct term_req* req)
 {
-    handler_perform(p, lambda(void, (struct peer* pp)
+    struct iovec body[2];
+
+    if(MSG_EMPTY == req->msg || '\0' == req->msg[0])
     {
-        login = pp->p_username;
-    }));
-    return login;
+        send_resp(p, req->status, NULL, 0);
+        return;
+    }
+    body[0].iov_base = (char*) req->msg;
+    body[0].iov_len = strlen(req->msg);
+    body[1].iov_base = "\r\n";
+    body[1].iov_len = 2;
+    send_resp(p, req->status, body, 2);
 }
 
 static int
@@ -65,28 +140,10 @@ check_username(const char* inp, const char* login)
 }
 
 static int
-isitpeer(struct peer* p, char* inp)
-{
-    char* login = NULL;
-
-    login = get_username(p, login);
-    return check_username(inp, login);
-}
-
-static int
-find_in_db(FILE* fdb, const char* login, const char* pass)
+isitpeer(struct peer* p, const char* inp)
 {
-    char l[11];
-    char p[11];
-    char m;
-
-    while(3 == fscanf(fdb, " %10[a-zA-Z] %10[^;\t\r\n ] %hhd", l, p, &m))
-    {
-        if(0 == strcmp(login, l) && 0 == strcmp(pass, p))
-            return m;
-    }
-
-    return PEER_NO_PERMS;
+    // only this thread changes the name, so it is safe to keep it
+    return check_username(inp, peer_get_username(p));
 }
 
 static void
@@ -94,181 +151,201 @@ do_auth(struct peer* p, struct term_req* req)
 {
     if(PEER_NO_PERMS == peer_get_mode(p))
     {
-        char login[11];
-        char pass[11];
+        char login[ACCOUNTS_LOGIN_SIZE];
+        char pass[ACCOUNTS_PASS_SIZE];
         int rv;
 
-        rv = sscanf(req->path, "%10[a-zA-Z];%10s", login, pass);
+        rv = sscanf(req->arg, "%10[a-zA-Z];%10s", login, pass);
         if(2 == rv)
         {
-            FILE* db = fopen(DB_ACCOUNTS, "r");
-            if(NULL != db)
+            rv = accounts_check(login, pass);
+            if(-1 != rv)
             {
-                rv = find_in_db(db, login, pass);
-                if(rv != 0)
+                if(rv != PEER_NO_PERMS)
                 {
+                    // the mode goes last: it tells readers the peer is ready
+                    peer_set_cwd(p, DEFAULT_PATH);
+                    peer_set_username(p, login);
                     peer_set_mode(p, rv);
-                    handler_perform(p, lambda(void, (struct peer* pp)
-                    {
-                        pp->p_username = malloc(11);
-
-                        peer_set_cwd(p, DEFAULT_PATH, 0);
-                        strcpy(p->p_username, login);
-                    }));
+                    who_update(p);
 
                     req->status = OK;
                     req->msg = AUTH_GRANTED;
-                    logger_log("[service] auth: ok\n");
+                    logger_info("[service] auth: ok\n");
                 }
                 else
                 {
                     req->status = FORBIDDEN;
                     req->msg = AUTH_BAD_TRY;
-                    logger_log("[service] bad login or pass\n");
+                    logger_warn("[service] bad login or pass\n");
                 }
-                fclose(db);
             }
             else
             {
                 req->status = INTERNAL_ERROR;
-                logger_log("[sevice] db error: %s\n", strerror(errno));
+                logger_error("[service] db error: no accounts loaded\n");
             }
         }
         else
         {
             req->status = BAD_REQUEST;
-            logger_log("[service] login & pass bad format\n");
+            logger_debug("[service] login & pass bad format\n");
         }
     }
     else
     {
         req->status = OK;
         req->msg = AUTH_MULTIPLE;
-        logger_log("[service] auth multiple times\n");
+        logger_warn("[service] auth multiple times\n");
     }
     small_resp(p, req);
 }
 
+static void
+close_fd(void* arg)
+{
+    int fd = *(int*) arg;
+    if(-1 != fd)
+        close(fd);
+}
+
+static void
+put_listing(void* arg)
+{
+    listing_put((struct listing*) arg);
+}
+
+struct ls_stream
+{
+    struct peer* s_peer;
+    int s_isstarted;
+    int s_flags;
+};
+
+/**
+ * Sends a part of the listing as a chunk, the first one right behind
+ * the header. An empty part ends the body. In a deflate session every
+ * part is deflated on its own. A loop's peer is paced like a thread's,
+ * the listing does not pile up in p_out.
+ */
 static int
-count_names_len(int fdcwd, struct term_req* req)
+send_ls_chunk(void* arg, const char* data, size_t len)
 {
+    struct ls_stream* s = (struct ls_stream*) arg;
+    char header[64];
+    char chunk[24];
+    struct iovec iov[3];
+    struct iovec part = {(char*) data, len};
     int cnt = 0;
-    struct dirent* entry;
-    DIR* root;
-    int dirfd = openat(fdcwd, req->path, O_RDONLY);
 
-    req->status = OK;
-    if(-1 == dirfd)
+    if(!s->s_isstarted)
     {
-        switch(errno)
-        {
-            case EACCES:
-                req->status = FORBIDDEN;
-                break;
-            case ENOENT:
-                req->status = NOT_FOUND;
-                break;
-            default:
-                req->status = INTERNAL_ERROR;
-        }
-        return -1;
+        if(NULL != s->s_peer->p_zip)
+            s->s_flags = TERM_F_DEFLATE;
+        iov[cnt].iov_base = header;
+        iov[cnt++].iov_len = put_header(s->s_peer, header, sizeof(header),
+                OK, TERM_CHUNKED, s->s_flags);
+        s->s_isstarted = 1;
     }
-
-    root = fdopendir(dirfd);
-    if(NULL == root)
-    {
-        if(ENOTDIR == errno)
-        {
-            req->status = NOT_DIR;
-        }
-        close(dirfd);
+    if(0 < len && (s->s_flags & TERM_F_DEFLATE)
+            && -1 == deflate_body(s->s_peer, &part, 1, &part))
         return -1;
-    }
-
-    while(NULL != (entry = readdir(root)))
-    {
-        if(entry->d_name[0] != '.')
-        {
-            cnt += strlen(entry->d_name) + 2; // + \r\n
-            cnt += (DT_DIR == entry->d_type) ? 1 : 0; // mark /
-        }
-    }
-    closedir(root);
-
-    return cnt;
+    iov[cnt].iov_base = chunk;
+    iov[cnt++].iov_len = put_chunk(s->s_peer, chunk, sizeof(chunk),
+            part.iov_len);
+    if(0 < len)
+        iov[cnt++] = part;
+    if(-1 == peer_sendv(s->s_peer, iov, cnt))
+        return -1;
+    return peer_pace(s->s_peer);
 }
 
-static void
+/**
+ * The listing goes out right behind the header, straight from the cache
+ * or from the thread's arena. A peer speaking PROTO 2 gets a directory
+ * that has to be read in chunks, while it is being read.
+ * Returns 1 if the peer has to be dropped: a chunked body broke off.
+ */
+static int
 do_ls(struct peer* p, struct term_req* req)
 {
-    size_t n = 0;
-    msgsize_t bs = p->p_buflen;
-    char* buf = p->p_buffer;
-    DIR* root;
-    int fdcwd;
-
-    handler_perform(p, lambda(void, (struct peer* pp)
+    int rv = -1;
+    int err;
+    int dirfd = p->p_cwd;
+    int ownfd = -1;
+    const char* path = req->arg;
+    struct listing l;
+    struct iovec iov;
+    struct ls_stream s = {p, 0, 0};
+    // a stream waits for its client, a loop must not: it sends it whole
+    int isstream = (TERM_PROTO_2 <= p->p_proto
+            && (NULL == p->p_loop || p->p_isworker));
+
+    if(peer_isconfined())
     {
-        fdcwd = pp->p_cwd;
-    }));
-
-    int cnt = count_names_len(fdcwd, req);
-    if(0 > cnt)
+        // the listing does not know the root, so it gets the directory
+        ownfd = dirfd = peer_resolve(p, req->arg);
+        path = ".";
+    }
+    pthread_cleanup_push(close_fd, &ownfd);
+    if(-1 != dirfd)
+        rv = listing_get(dirfd, path, &l,
+                isstream ? send_ls_chunk : NULL, &s);
+    err = errno;
+    pthread_cleanup_pop(1);
+    errno = err;
+    if(-1 == rv && s.s_isstarted)
     {
-        error_term(p->p_sfd, req);
-        logger_log("[service] cant read a dir: %s\n", strerror(errno));
-        return;
+        logger_warn("[service] peer #%u: the listing broke off: %s\n",
+                p->p_id, strerror(errno));
+        return 1;
     }
-    
-    n = term_put_header(buf, bs, req->status, cnt);
-    if(0 < cnt)
+    if(-1 == rv)
     {
-        msgsize_t prev;
-        struct dirent* entry;
-
-        root = fdopendir(openat(fdcwd, req->path, O_RDONLY));
-        while(NULL != (entry = readdir(root)))
+        switch(errno)
         {
-            if(entry->d_name[0] != '.')
-            {
-                prev = n;
-                n += snprintf(buf + n, bs - n, "%s%s\r\n", entry->d_name,
-                        (DT_DIR == entry->d_type) ? "/" : "");
-                if(n >= bs)
-                {
-                    size_t tosend = prev;
-                    sendall(p->p_sfd, buf, &tosend);
-                    prev = 0;
-                    n = sprintf(buf, "%s%s\r\n", entry->d_name,
-                        (DT_DIR == entry->d_type) ? "/" : "");
-                }
-            }
+            case EACCES:
+                req->status = FORBIDDEN;
+                break;
+            case ENOENT:
+                req->status = NOT_FOUND;
+                break;
+            case ENOTDIR:
+                req->status = NOT_DIR;
+                break;
+            default:
+                req->status = INTERNAL_ERROR;
         }
-        closedir(root);
+        logger_debug("[service] cant read a dir: %s\n", strerror(errno));
+        error_term(p, req);
+        return 0;
     }
 
-    sendall(p->p_sfd, buf, &n);
+    req->status = OK;
+    if(NULL == l.l_data)
+        return (-1 == send_ls_chunk(&s, NULL, 0)) ? 1 : 0;
+
+    iov.iov_base = (char*) l.l_data;
+    iov.iov_len = l.l_len;
+    // a peer thread may be cancelled while it sends
+    pthread_cleanup_push(put_listing, &l);
+    send_resp(p, req->status, &iov, 1);
+    pthread_cleanup_pop(1);
+    return 0;
 }
 
 static void
 do_cd(struct peer* p, struct term_req* req)
 {
-    int rv;
-    handler_perform(p, lambda(void, (struct peer* pp)
-    {
-        rv = peer_set_cwd(pp, req->path, TERMPROTO_PATH_SIZE);
-    }));
+    int rv = peer_set_cwd(p, req->arg);
     if(0 == rv)
     {
-        char* path;
-        handler_perform(p, lambda(void, (struct peer* pp)
-        {
-            path = pp->p_cwdpath;
-        }));
+        char* path = peer_show_cwd(p);
+        who_update(p);
         req->status = OK;
-        req->msg = path;
+        req->msg = (NULL != path) ? path : MSG_EMPTY;
         small_resp(p, req);
-        logger_log("[service] chdir=%s\n", path);
+        logger_debug("[service] chdir=%s\n", req->msg);
     }
     else
     {
@@ -286,9 +363,9 @@ do_cd(struct peer* p, struct term_req* req)
             default:
                 req->status = INTERNAL_ERROR;
         }
-        logger_log("[service] chdir failed: %s\n",
+        logger_debug("[service] chdir failed: %s\n",
                 strerror(errno));
-        error_term(p->p_sfd, req);
+        error_term(p, req);
     }
 }
 
@@ -297,12 +374,12 @@ do_kill(struct peer* p, struct term_req* req)
 {
     int rv;
 
-    if(! isitpeer(p, req->path))
+    if(! isitpeer(p, req->arg))
     {
         rv = handler_delete_all_if(lambda(int, (struct peer* predic)
         {
             if(NULL != predic->p_username)
-                return NULL != strstr(req->path, predic->p_username);
+                return NULL != strstr(req->arg, predic->p_username);
             else
                 return 0;
         }));
@@ -316,169 +393,266 @@ do_kill(struct peer* p, struct term_req* req)
     small_resp(p, req);
 }
 
+static void
+put_who(void* arg)
+{
+    who_put((struct who*) arg);
+}
+
 static void
 do_who(struct peer* p, struct term_req* req)
 {
-    msgsize_t n;
-    msgsize_t offset;
-    size_t tocpy;
-    size_t tosend;
-    int peers_cnt = 0;
-    int bsize = 6 * TERMPROTO_BUF_SIZE; // big enough for 20 peers
-    char* buf = malloc(bsize);
-
-    if(NULL == buf)
+    struct iovec iov;
+    struct who w;
+
+    if(-1 == who_get(&w))
     {
-        logger_log("[service] who: malloc failed\n");
+        logger_error("[service] who: malloc failed\n");
         req->status = INTERNAL_ERROR;
-        error_term(p->p_sfd, req);
+        error_term(p, req);
         return;
     }
 
-    offset = sprintf(buf, "ID\tUNAME\tMODE\tCWD\n");
-    handler_foreach(lambda(void, (struct peer* pp)
-    {
-        char mode = peer_get_mode(pp);
-        if(0 != mode)
-        {
-            ++peers_cnt;
-            offset += sprintf(buf + offset, "%d\t%s\t%d\t%s\n",
-                    pp->p_id, pp->p_username, mode,
-                    pp->p_cwdpath);
-        }
-    }));
-    offset += sprintf(buf + offset, "TOTAL: %d\n", peers_cnt);
-
     req->status = OK;
-    n = term_put_header(p->p_buffer, p->p_buflen, req->status, offset);
-    if(n + offset <= p->p_buflen)
+    iov.iov_base = (char*) w.w_data;
+    iov.iov_len = w.w_len;
+    pthread_cleanup_push(put_who, &w);
+    send_resp(p, req->status, &iov, 1);
+    pthread_cleanup_pop(1);
+}
+
+static void
+do_logout(struct peer* p, struct term_req* req)
+{
+    if(isitpeer(p, req->arg))
     {
-        tocpy = offset;
-        strncpy(p->p_buffer + n, buf, tocpy);
-        tosend = tocpy + n;
-        sendall(p->p_sfd, p->p_buffer, &tosend);
+        logger_info("[service] logout: username=%s\n", req->arg);
+        req->status = OK;
     }
     else
     {
-        tocpy = p->p_buflen - n;
-        strncpy(p->p_buffer + n, buf, tocpy);
-        tosend = p->p_buflen;
-        sendall(p->p_sfd, p->p_buffer, &tosend);
-        tocpy = offset - p->p_buflen;
-        sendall(p->p_sfd, buf + p->p_buflen, &tocpy);
+        req->status = BAD_REQUEST;
     }
-    
-    free(buf);
+    small_resp(p, req);
 }
 
+/**
+ * Agrees on the highest revision both sides know. The answer itself
+ * is framed in the old one, the new one applies to what follows.
+ * "deflate" after the revision turns on compression, every PROTO
+ * without it turns it off.
+ */
 static void
-do_logout(struct peer* p, struct term_req* req)
+do_proto(struct peer* p, struct term_req* req)
 {
-    if(isitpeer(p, req->path))
+    char rev[16];
+    char* opt;
+    long want = strtol(req->arg, &opt, 10);
+    int iszip;
+
+    if(TERM_PROTO_1 > want)
     {
-        logger_log("[service] logout: username=%s\n", req->path);
-        req->status = OK;
+        req->status = BAD_REQUEST;
+        small_resp(p, req);
+        return;
     }
-    else
+    if(TERM_PROTO_MAX < want)
+        want = TERM_PROTO_MAX;
+
+    while(' ' == *opt)
+        ++opt;
+    iszip = (TERM_PROTO_2 <= want && 0 == strcmp(opt, "deflate"));
+    if(!iszip)
     {
-        req->status = BAD_REQUEST;
+        compress_free(p->p_zip);
+        p->p_zip = NULL;
+    }
+    else if(NULL == p->p_zip && NULL == (p->p_zip = compress_new()))
+    {
+        logger_debug("[service] peer #%u: no deflate stream\n", p->p_id);
+        iszip = 0;
     }
+
+    snprintf(rev, sizeof(rev), iszip ? "%ld deflate" : "%ld", want);
+    req->status = OK;
+    req->msg = rev;
     small_resp(p, req);
+    p->p_proto = want;
+    logger_info("[service] peer #%u speaks rev %ld%s\n", p->p_id, want,
+            iszip ? " with deflate" : "");
 }
 
+/**
+ * Answers a parsed request, rv is what the parser returned.
+ * Returns 1 if the peer leaves.
+ */
 static int
-handle_req(struct peer* p)
+handle_req(struct peer* p, struct term_req* req, int rv)
 {
-    int rv;
-    struct term_req req;
-
-    rv = term_parse_req(&req, p->p_buffer);
     if(0 == rv)
     {
-        req.msg = MSG_EMPTY;
-        int methiskill = (req.method == KILL);
+        req->msg = MSG_EMPTY;
+        int methiskill = (req->method == KILL);
 
-        if(PEER_SUPER == peer_get_mode(p) && methiskill)
+        if(PROTO == req->method)
+        {
+            do_proto(p, req);
+        }
+        else if(PEER_SUPER == peer_get_mode(p) && methiskill)
         {
-            do_kill(p, &req);
+            do_kill(p, req);
         }
         else if(PEER_NO_PERMS < peer_get_mode(p) && !methiskill)
         {
-            switch(req.method)
+            switch(req->method)
             {
                 case AUTH:
-                    do_auth(p, &req);
+                    do_auth(p, req);
                     break;
                 case CD:
-                    do_cd(p, &req);
+                    do_cd(p, req);
                     break;
                 case LS:
-                    do_ls(p, &req);
+                    if(1 == do_ls(p, req))
+                        return 1;
                     break;
                 case WHO:
-                    do_who(p, &req);
+                    do_who(p, req);
                     break;
                 case LOGOUT:
-                    do_logout(p, &req);
-                    if(OK == req.status)
+                    do_logout(p, req);
+                    if(OK == req->status)
                         return 1;
                     break;
                 default:
-                    logger_log("[handler] not implemented\n");
+                    logger_debug("[service] not implemented\n");
             }
         }
-        else if(req.method == AUTH)
+        else if(req->method == AUTH)
         {
-            do_auth(p, &req);
+            do_auth(p, req);
         }
         else
         {
-            req.status = FORBIDDEN;
-            small_resp(p, &req);
+            req->status = FORBIDDEN;
+            small_resp(p, req);
         }
     }
     else
     {
-        error_term(p->p_sfd, &req);
+        logger_debug("[service] bad request: %s\n", term_parse_strerror(rv));
+        error_term(p, req);
     }
     return 0;
 }
 
+/**
+ * Takes the next complete request out of p_in, a line or a binary frame,
+ * and answers it. Returns 1 if one was answered, 0 if none is complete
+ * yet, 2 if the peer leaves after the answers queued so far, -1 if the
+ * input cannot be a request: it is too long or not a frame.
+ */
+int
+service_next(struct peer* p)
+{
+    int rv;
+    char* line;
+    size_t len;
+    struct term_req req;
+    size_t size = iobuf_size(&p->p_in);
+
+    if(TERM_PROTO_BIN == p->p_proto)
+    {
+        line = p->p_in.b_data + p->p_in.b_off;
+        len = term_bin_reqlen(line, size);
+        if(TERMPROTO_BUF_SIZE < len)
+        {
+            logger_debug("[service] peer #%u: a bad frame\n", p->p_id);
+            return -1;
+        }
+        if(0 == len || size < len)
+            return 0;
+        rv = term_parse_bin_req(&req, line);
+        iobuf_consume(&p->p_in, len);
+    }
+    else
+    {
+        if(!iobuf_getline(&p->p_in, &line, &len))
+        {
+            if(size < TERMPROTO_BUF_SIZE)
+                return 0;
+            logger_debug("[service] peer #%u: the line is too long\n",
+                    p->p_id);
+            return -1;
+        }
+        req.id = 0;
+        rv = term_parse_req(&req, line);
+    }
+
+    p->p_reqid = req.id;
+    return (1 == handle_req(p, &req, rv)) ? 2 : 1;
+}
+
+/**
+ * Every complete request already received is answered before the next
+ * recv(), and the answers are flushed together, so a client pipelining
+ * N requests waits for one round trip instead of N.
+ */
 void
 service(struct peer* p)
 {
-    int sfd = p->p_sfd;
+    int rv;
     size_t len = TERMPROTO_BUF_SIZE;
     char* buffer = malloc(len);
 
-    if(NULL != buffer)
+    if(NULL != buffer && 0 == iobuf_init(&p->p_in, len)
+            && 0 == iobuf_init(&p->p_out, len))
     {
         p->p_buffer = buffer;
         p->p_buflen = len;
 
         while(1)
         {
-            int rv = readcrlf(sfd, buffer, len);
-            if(0 < rv)
+            rv = service_next(p);
+            if(2 == rv || -1 == rv)
+            {
+                peer_flush(p);
+                return;
+            }
+            if(1 == rv)
+            {
+                if(iobuf_size(&p->p_out) >= PEER_OUT_HIGH
+                        && -1 == peer_flush(p))
+                {
+                    logger_warn("[service] send: %s\n", strerror(errno));
+                    break;
+                }
+                continue;
+            }
+
+            // the batch is over, answer it before waiting for more
+            if(-1 == peer_flush(p))
             {
-                rv = handle_req(p);
-                if(1 == rv)
-                    return;
+                logger_warn("[service] send: %s\n", strerror(errno));
+                break;
             }
-            else if(0 == rv)
+
+            rv = recvbuf(p->p_sfd, &p->p_in, len);
+            if(0 == rv)
             {
-                logger_log("[handler] peer #%hd hung up\n", p->p_id);
+                logger_info("[service] peer #%u hung up\n", p->p_id);
                 break;
             }
-            else
+            else if(0 > rv)
             {
-                logger_log("[handler] readcrlf: %s\n", strerror(errno));
+                logger_warn("[service] recv: %s\n", strerror(errno));
                 break;
             }
         }
     }
     else
     {
-        logger_log("[peer] malloc failed: %s\n", strerror(errno));
+        free(buffer);
+        logger_error("[service] malloc failed: %s\n", strerror(errno));
     }
 }
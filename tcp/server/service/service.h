@@ -6,4 +6,7 @@
 void
 service(struct peer* p);
 
+int
+service_next(struct peer* p);
+
 #endif
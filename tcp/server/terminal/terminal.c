@@ -1,6 +1,9 @@
 #include "logger/logger.h"
+#include "server/dircache/dircache.h"
 #include "server/handler/handler.h"
+#include "server/listing/listing.h"
 #include "server/terminal/terminal.h"
+#include "server/who/who.h"
 
 #include <pthread.h>
 #include <stdio.h>
@@ -8,49 +11,77 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#define LOGGER_CATEGORY LOGGER_CAT_TERMINAL
+
 static struct termdata this;
 
 static void
 terminal_action_quit()
 {
-    logger_log("[terminal] shutdown requested\n");
+    logger_info("[terminal] shutdown requested\n");
     if(NULL != this.td_stopserver)
     {
         this.td_stopserver();
     }
     else
     {
-        logger_log("[terminal] callback == NULL\n");
+        logger_error("[terminal] callback == NULL\n");
     }
 }
 
 static void
 terminal_action_show_status()
 {
-    logger_log("[terminal] showing statistics\n");
-    printf("Online peers: %d\nServed peers for all time: %d\n",
+    logger_info("[terminal] showing statistics\n");
+    printf("Online peers: %u\nServed peers for all time: %u\n",
             handler_getcurrent(), handler_gettotal());
+    listing_printinfo();
+    dircache_printinfo();
+    who_printinfo();
     handler_foreach(&peer_printinfo);
 }
 
 static void
 terminal_action_kill(peer_t peer)
 {
-    logger_log("[terminal] kill %hd\n", peer);
+    logger_info("[terminal] kill %u\n", peer);
     handler_delete_first_if(
             lambda(int, (struct peer* p)
                 {return p->p_id == peer && p->p_id != 0;}
             ));
 }
 
+/**
+ * "log" shows the levels, "log <level> [category]" sets them.
+ */
+static void
+terminal_action_log(const char* args)
+{
+    char level[16];
+    char category[16];
+    int n = sscanf(args, "%15s %15s", level, category);
+
+    if(0 >= n)
+    {
+        logger_printlevels();
+        return;
+    }
+    if(-1 == logger_setlevel((2 == n) ? category : NULL, level))
+    {
+        printf("Usage: log [error|warn|info|debug [category]]\n");
+        return;
+    }
+    logger_info("[terminal] log %s %s\n", level, (2 == n) ? category : "all");
+}
+
 static void*
 terminal_loop()
 {
     peer_t peer;
-    int cmdsize = 10;
+    int cmdsize = 48;
     char inpline[cmdsize];
 
-    logger_log("[terminal] started\n");
+    logger_info("[terminal] started\n");
     printf("> ");
     while(1)
     {
@@ -64,10 +95,15 @@ terminal_loop()
         {
             terminal_action_show_status();
         }
-        else if(1 == sscanf(inpline, "k %hd\n", &peer))
+        else if(1 == sscanf(inpline, "k %u\n", &peer))
         {
             terminal_action_kill(peer);
         }
+        else if(0 == strncmp(inpline, "log", 3)
+                && ('\n' == inpline[3] || ' ' == inpline[3]))
+        {
+            terminal_action_log(inpline + 3);
+        }
         printf("> ");
     }
 
@@ -83,14 +119,14 @@ terminal_setstopservercb(void (*stopserver_cb)(void))
 void
 terminal_run()
 {
-    logger_log("[terminal] starting...\n");
+    logger_info("[terminal] starting...\n");
     pthread_create(&this.td_tid, NULL, terminal_loop, NULL);
 }
 
 void
 terminal_join()
 {
-    logger_log("[terminal] joining...\n");
+    logger_info("[terminal] joining...\n");
     pthread_cancel(this.td_tid); // to be shure
     pthread_join(this.td_tid, NULL);
 }
@@ -0,0 +1,278 @@
+#include "logger/logger.h"
+#include "server/who/who.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOGGER_CATEGORY LOGGER_CAT_WHO
+
+static const char * const WHO_HEADER = "ID\tUNAME\tMODE\tCWD\n";
+
+struct row
+{
+    char* r_text; // NULL for a slot nobody logged in
+    size_t r_len;
+};
+
+/**
+ * An immutable rendering of the table, shared by everyone who is
+ * sending it. The table itself keeps one reference to the latest.
+ */
+struct snapshot
+{
+    int s_refs;
+    unsigned long s_version;
+    size_t s_len;
+    char s_data[];
+};
+
+static pthread_mutex_t g_mx = PTHREAD_MUTEX_INITIALIZER;
+static struct row* g_rows; // indexed by the registry slot
+static unsigned int g_rowscap;
+static unsigned int g_count;
+static size_t g_size; // all the rows together
+static unsigned long g_version;
+static struct snapshot* g_snap;
+static unsigned long g_served;
+static unsigned long g_rebuilds;
+
+static void
+unref(struct snapshot* s)
+{
+    if(NULL != s && 0 == __sync_sub_and_fetch(&s->s_refs, 1))
+        free(s);
+}
+
+static int
+reserve(unsigned int slot)
+{
+    unsigned int cap;
+    struct row* rows;
+
+    if(slot < g_rowscap)
+        return 0;
+    cap = (0 == g_rowscap) ? WHO_ROWS_MIN : 2 * g_rowscap;
+    while(cap <= slot)
+    {
+        cap *= 2;
+    }
+    rows = realloc(g_rows, cap * sizeof(struct row));
+    if(NULL == rows)
+        return -1;
+    memset(rows + g_rowscap, 0, (cap - g_rowscap) * sizeof(struct row));
+    g_rows = rows;
+    g_rowscap = cap;
+    return 0;
+}
+
+/**
+ * Puts the text into the slot and returns what was there before.
+ */
+static char*
+setrow(unsigned int slot, char* text, size_t len)
+{
+    struct row* r = &g_rows[slot];
+    char* old = r->r_text;
+
+    if(NULL != old && NULL != text && r->r_len == len
+            && 0 == memcmp(old, text, len))
+        return text; // nothing to show anew
+
+    if(NULL != old)
+    {
+        --g_count;
+        g_size -= r->r_len;
+    }
+    if(NULL != text)
+    {
+        ++g_count;
+        g_size += len;
+    }
+    r->r_text = text;
+    r->r_len = len;
+    ++g_version;
+    return old;
+}
+
+static struct snapshot*
+rebuild()
+{
+    char total[32];
+    int totallen = sprintf(total, "TOTAL: %u\n", g_count);
+    size_t headerlen = strlen(WHO_HEADER);
+    size_t len = headerlen + g_size + totallen;
+    struct snapshot* s = malloc(sizeof(struct snapshot) + len);
+    char* at;
+    unsigned int i;
+
+    if(NULL == s)
+        return NULL;
+    s->s_refs = 1;
+    s->s_version = g_version;
+    s->s_len = len;
+    at = s->s_data;
+    memcpy(at, WHO_HEADER, headerlen);
+    at += headerlen;
+    for(i = 0; i < g_rowscap; ++i)
+    {
+        if(NULL != g_rows[i].r_text)
+        {
+            memcpy(at, g_rows[i].r_text, g_rows[i].r_len);
+            at += g_rows[i].r_len;
+        }
+    }
+    memcpy(at, total, totallen);
+    ++g_rebuilds;
+    return s;
+}
+
+int
+who_init()
+{
+    g_rows = NULL;
+    g_rowscap = 0;
+    g_count = 0;
+    g_size = 0;
+    g_version = 0;
+    g_snap = NULL;
+    g_served = 0;
+    g_rebuilds = 0;
+    return 0;
+}
+
+void
+who_destroy()
+{
+    unsigned int i;
+
+    for(i = 0; i < g_rowscap; ++i)
+    {
+        free(g_rows[i].r_text);
+    }
+    free(g_rows);
+    unref(g_snap);
+    g_rows = NULL;
+    g_rowscap = 0;
+    g_snap = NULL;
+}
+
+void
+who_update(struct peer* p)
+{
+    int state;
+    int len;
+    char* text = NULL;
+    char* old;
+    char mode = peer_get_mode(p);
+    char* username = peer_get_username(p);
+    char* cwdpath = peer_show_cwd(p);
+
+    if(0 != mode && NULL != username && NULL != cwdpath)
+    {
+        len = snprintf(NULL, 0, "%d\t%s\t%d\t%s\n",
+                p->p_id, username, mode, cwdpath);
+        text = malloc(len + 1);
+        if(NULL == text)
+        {
+            logger_error("[who] malloc failed\n");
+            who_remove(p);
+            return;
+        }
+        sprintf(text, "%d\t%s\t%d\t%s\n", p->p_id, username, mode, cwdpath);
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&g_mx);
+    if(-1 == reserve(p->p_slot))
+    {
+        old = text; // the peer is not shown rather than shown wrong
+        text = NULL;
+    }
+    else
+    {
+        old = setrow(p->p_slot, text, (NULL != text) ? (size_t) len : 0);
+    }
+    pthread_mutex_unlock(&g_mx);
+    pthread_setcancelstate(state, NULL);
+    free(old);
+}
+
+void
+who_remove(struct peer* p)
+{
+    int state;
+    char* old = NULL;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&g_mx);
+    if(p->p_slot < g_rowscap)
+        old = setrow(p->p_slot, NULL, 0);
+    pthread_mutex_unlock(&g_mx);
+    pthread_setcancelstate(state, NULL);
+    free(old);
+}
+
+int
+who_get(struct who* w)
+{
+    int state;
+    struct snapshot* s;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&g_mx);
+    if(NULL == g_snap || g_snap->s_version != g_version)
+    {
+        s = rebuild();
+        if(NULL != s)
+        {
+            unref(g_snap);
+            g_snap = s;
+        }
+    }
+    s = g_snap;
+    if(NULL != s && s->s_version == g_version)
+    {
+        __sync_add_and_fetch(&s->s_refs, 1);
+        ++g_served;
+    }
+    else
+    {
+        s = NULL;
+    }
+    pthread_mutex_unlock(&g_mx);
+    pthread_setcancelstate(state, NULL);
+
+    if(NULL == s)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    w->w_data = s->s_data;
+    w->w_len = s->s_len;
+    w->w_ref = s;
+    return 0;
+}
+
+void
+who_put(struct who* w)
+{
+    unref((struct snapshot*) w->w_ref);
+    w->w_ref = NULL;
+}
+
+void
+who_printinfo()
+{
+    int state;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&g_mx);
+    printf("WHO table: %u rows, %zu bytes, version %lu\n"
+            "\tServed: %lu, rebuilt: %lu\n",
+            g_count, g_size, g_version, g_served, g_rebuilds);
+    pthread_mutex_unlock(&g_mx);
+    pthread_setcancelstate(state, NULL);
+}
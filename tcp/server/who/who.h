@@ -0,0 +1,50 @@
+#ifndef WHO_H
+#define WHO_H
+
+#include "server/handler/peer/peer.h"
+
+#include <stddef.h>
+
+#define WHO_ROWS_MIN 64
+
+/**
+ * A rendered WHO table. It stays valid until who_put(), even if the
+ * table changes meanwhile.
+ */
+struct who
+{
+    const char* w_data;
+    size_t w_len;
+    void* w_ref; // the snapshot
+};
+
+int
+who_init();
+
+void
+who_destroy();
+
+/**
+ * Renders the row of a logged in peer again, a peer without a mode
+ * has no row. Only the thread serving the peer may call it.
+ */
+void
+who_update(struct peer* p);
+
+void
+who_remove(struct peer* p);
+
+/**
+ * Takes the current table, it is rebuilt only if some row has changed
+ * since the last call. Returns -1 if out of memory.
+ */
+int
+who_get(struct who* w);
+
+void
+who_put(struct who* w);
+
+void
+who_printinfo();
+
+#endif
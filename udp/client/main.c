@@ -15,6 +15,7 @@ static unsigned short int g_seq;
 static struct term_req g_req;
 static char g_running = 0;
 static int g_len;
+static char g_isbin = 1; // until the server shows it knows only text
 static const int g_bufsize = TERMPROTO_BUF_SIZE;
 static char g_buf[TERMPROTO_BUF_SIZE];
 
@@ -206,7 +207,10 @@ send_req()
     size_t n;
 
     g_req.seq = ++g_seq;
-    n = term_mk_req_header(&g_req, g_buf, g_bufsize);
+    if(g_isbin)
+        n = term_mk_bin_req(&g_req, g_buf, g_bufsize);
+    else
+        n = term_mk_req_header(&g_req, g_buf, g_bufsize);
     if(-1 == send(g_sfd, g_buf, n, MSG_NOSIGNAL))
     {
         error("send() failed", 0, exit);
@@ -238,7 +242,22 @@ recv_resp()
     }
     g_buf[(g_bufsize == g_len) ? g_len - 1 : g_len] = '\0';
 
-    if(0 == (rv = term_parse_resp_status(&g_req, g_buf)))
+    if(term_is_bin(g_buf, g_len))
+    {
+        rv = term_parse_bin_resp(&g_req, g_buf, g_len);
+    }
+    else if(g_isbin)
+    {
+        // an old server answers a frame with a text error, ask again
+        g_isbin = 0;
+        return;
+    }
+    else
+    {
+        rv = term_parse_resp_status(&g_req, g_buf);
+    }
+
+    if(0 == rv)
     {
         if(g_req.seq != g_seq)
         {
@@ -284,9 +303,15 @@ recv_resp()
 void
 handle_cmd()
 {
-    send_req();
+    char isbin = g_isbin;
 
+    send_req();
     recv_resp();
+    if(isbin && !g_isbin)
+    {
+        send_req();
+        recv_resp();
+    }
 }
 
 int
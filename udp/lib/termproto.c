@@ -27,6 +27,60 @@ static const char * const TERM_STATUS_ALL[] = {
     "500", "Internal Server Error"
 };
 
+/* " <code> <text>\r\n" for every status, indexed by status / 2 */
+#define TERM_LINE(code, text) \
+    { " " code " " text "\r\n", sizeof(" " code " " text "\r\n") - 1 }
+
+static const struct
+{
+    const char* sl_str;
+    size_t sl_len;
+} TERM_STATUS_LINE[] = {
+    TERM_LINE("200", "OK"),
+    TERM_LINE("400", "Bad Request"),
+    TERM_LINE("403", "Forbidden"),
+    TERM_LINE("404", "Not Found"),
+    TERM_LINE("405", "Not a Directory"),
+    TERM_LINE("500", "Internal Server Error")
+};
+
+static const char DIGITS2[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/**
+ * Writes v in decimal, two digits per step, and returns the length.
+ * buf has to hold 10 bytes; no terminator is written.
+ */
+static size_t
+term_utoa(char* buf, unsigned int v)
+{
+    char tmp[10];
+    char* p = tmp + sizeof(tmp);
+    size_t n;
+
+    while(100 <= v)
+    {
+        p -= 2;
+        memcpy(p, DIGITS2 + 2 * (v % 100), 2);
+        v /= 100;
+    }
+    if(10 <= v)
+    {
+        p -= 2;
+        memcpy(p, DIGITS2 + 2 * v, 2);
+    }
+    else
+    {
+        *--p = '0' + v;
+    }
+
+    n = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, n);
+    return n;
+}
+
 char*
 term_get_method_str(int method)
 {
@@ -107,14 +161,24 @@ term_parse_req(struct term_req* req, const char* buf)
     return -1;
 }
 
+/**
+ * The header is the sequence number and a precomputed status line.
+ * Returns 0 if it does not fit into buf.
+ */
 int
 term_put_header(char* buf, int bufsize, unsigned int seq,
     enum TERM_STATUS status)
 {
-    int n;
-    n = snprintf(buf, bufsize, "%u %s %s\r\n", seq,
-        TERM_STATUS_ALL[status], TERM_STATUS_ALL[status + 1]);
-    return (n < bufsize) ? n : bufsize;
+    char num[10];
+    size_t n = term_utoa(num, seq);
+    size_t len = TERM_STATUS_LINE[status / 2].sl_len;
+
+    if(n + len >= (size_t) bufsize)
+        return 0;
+    memcpy(buf, num, n);
+    memcpy(buf + n, TERM_STATUS_LINE[status / 2].sl_str, len);
+    buf[n + len] = '\0';
+    return n + len;
 }
 
 int
@@ -170,3 +234,114 @@ term_parse_resp_status(struct term_req* req, char* buf)
     }
     return 0;
 }
+
+static void
+put_be(char* buf, unsigned long long v, int n)
+{
+    while(0 < n--)
+    {
+        buf[n] = (char) (v & 0xff);
+        v >>= 8;
+    }
+}
+
+static unsigned long long
+get_be(const char* buf, int n)
+{
+    int i;
+    unsigned long long v = 0;
+
+    for(i = 0; i < n; ++i)
+        v = (v << 8) | (unsigned char) buf[i];
+    return v;
+}
+
+int
+term_is_bin(const char* buf, int len)
+{
+    return 0 < len && TERM_BIN_MAGIC == (unsigned char) buf[0];
+}
+
+/**
+ * Parses a binary request datagram of len bytes, the argument is copied
+ * into req->path. Like term_parse_req(), it sets req->seq as soon as
+ * the header is there, so that a bad request can still be answered.
+ */
+int
+term_parse_bin_req(struct term_req* req, const char* buf, int len)
+{
+    unsigned long long arglen;
+
+    req->seq = 0;
+    req->status = BAD_REQUEST;
+    if(TERM_BIN_REQ_SIZE > len || !term_is_bin(buf, len))
+        return -1;
+
+    req->seq = get_be(buf + 2, 2);
+    arglen = get_be(buf + 4, 4);
+    if(LOGOUT < (unsigned char) buf[1] || 0 == arglen
+            || TERMPROTO_PATH_SIZE <= arglen
+            || (unsigned long long) len - TERM_BIN_REQ_SIZE != arglen
+            || NULL != memchr(buf + TERM_BIN_REQ_SIZE, '\0', arglen))
+    {
+        logger_log("[termproto] Bad binary request\n");
+        return -1;
+    }
+
+    req->method = (unsigned char) buf[1];
+    memcpy(req->path, buf + TERM_BIN_REQ_SIZE, arglen);
+    req->path[arglen] = '\0';
+    return 0;
+}
+
+int
+term_mk_bin_req(struct term_req* req, char* buf, int bufsize)
+{
+    int arglen = strlen(req->path);
+
+    if(TERM_BIN_REQ_SIZE + arglen > bufsize)
+        return 0;
+    buf[0] = (char) TERM_BIN_MAGIC;
+    buf[1] = (char) req->method;
+    put_be(buf + 2, req->seq, 2);
+    put_be(buf + 4, arglen, 4);
+    memcpy(buf + TERM_BIN_REQ_SIZE, req->path, arglen);
+    return TERM_BIN_REQ_SIZE + arglen;
+}
+
+int
+term_put_bin_header(char* buf, int bufsize, unsigned int seq,
+    enum TERM_STATUS status, int size)
+{
+    if(TERM_BIN_RESP_SIZE > bufsize)
+        return 0;
+    buf[0] = (char) TERM_BIN_MAGIC;
+    buf[1] = (char) (status / 2);
+    put_be(buf + 2, seq, 2);
+    put_be(buf + 4, size, 8);
+    return TERM_BIN_RESP_SIZE;
+}
+
+/**
+ * Parses a binary response datagram of len bytes. req->msg points to
+ * the body, if any; the caller terminates it.
+ */
+int
+term_parse_bin_resp(struct term_req* req, char* buf, int len)
+{
+    int status;
+    unsigned long long size;
+
+    if(TERM_BIN_RESP_SIZE > len || !term_is_bin(buf, len))
+        return -1;
+    status = 2 * (unsigned char) buf[1];
+    size = get_be(buf + 4, 8);
+    if(INTERNAL_ERROR < status
+            || (unsigned long long) len - TERM_BIN_RESP_SIZE != size)
+        return -1;
+
+    req->status = status;
+    req->seq = get_be(buf + 2, 2);
+    req->msg = (0 < size) ? buf + TERM_BIN_RESP_SIZE : NULL;
+    return 0;
+}
@@ -7,6 +7,19 @@
 #define TERMPROTO_T1 5
 #define TERMPROTO_T2 5
 
+/*
+ * A datagram starting with TERM_BIN_MAGIC is a binary frame, all
+ * numbers big-endian. A request is the header
+ *     magic:8 method:8 seq:16 arglen:32
+ * and arglen raw bytes of the argument. A response is the header
+ *     magic:8 status:8 seq:16 size:64
+ * and the body, with status / 2 of TERM_STATUS. The server answers in
+ * the encoding of the request.
+ */
+#define TERM_BIN_MAGIC 0xb1
+#define TERM_BIN_REQ_SIZE 8
+#define TERM_BIN_RESP_SIZE 12
+
 enum TERM_METHOD {
     AUTH, LS, CD, KILL, WHO, LOGOUT
 };
@@ -52,4 +65,20 @@ term_mk_req_header(struct term_req* req, char* buf, int bufsize);
 int
 term_parse_resp_status(struct term_req* req, char* buf);
 
+int
+term_is_bin(const char* buf, int len);
+
+int
+term_parse_bin_req(struct term_req* req, const char* buf, int len);
+
+int
+term_mk_bin_req(struct term_req* req, char* buf, int bufsize);
+
+int
+term_put_bin_header(char* buf, int bufsize, unsigned int seq,
+    enum TERM_STATUS status, int size);
+
+int
+term_parse_bin_resp(struct term_req* req, char* buf, int len);
+
 #endif
@@ -1,3 +1,4 @@
+#include "lib/termproto.h"
 #include "lib/werror.h"
 #include "logger/logger.h"
 #include "server/handler/handler.h"
@@ -11,6 +12,7 @@
 /* from "service" module */
 extern const int g_period; // determines by protocol
 extern char* g_buf; // is going to be allocated in server_init()
+extern int g_buflen;
 extern const int g_bufsize; // determines by protocol
 
 struct serverdata
@@ -107,8 +109,10 @@ handle_master_socket(WSAEVENT event)
     if(0 < bytes)
     {
         g_buf[bytes] = '\0';
+        g_buflen = bytes;
 
-        logger_log("[server] received \"%s\"\n", g_buf);
+        if(!term_is_bin(g_buf, bytes))
+            logger_log("[server] received \"%s\"\n", g_buf);
         if(0 < (bytes = handler_new_request(&sa_peer)))
         {
             bytes = sendto(this.master, g_buf, bytes, 0,
@@ -18,6 +18,7 @@ static const char * const AUTH_BAD_TRY = "Unable to log in";
 static const char * const AUTH_GRANTED = "Successful authentication";
 
 char* g_buf;
+int g_buflen; // of the datagram in g_buf
 const int g_bufsize = TERMPROTO_BUF_SIZE;
 const int g_period  = (1000 * (TERMPROTO_T1 + TERMPROTO_T2));
 struct peer* g_peer;
@@ -25,12 +26,38 @@ LARGE_INTEGER g_frequency;
 
 static int g_bytes_to_send;
 static struct term_req g_req;
+static int g_isbin; // the request came as a binary frame
+
+/**
+ * Starts a response in g_buf and returns its length so far. The binary
+ * header needs the length of the body, end_resp() fills it in.
+ */
+static int
+begin_resp(unsigned int seq, int hasbody)
+{
+    int n;
+
+    if(g_isbin)
+        return TERM_BIN_RESP_SIZE;
+    n = term_put_header(g_buf, g_bufsize, seq, g_req.status);
+    if(hasbody)
+        n += sprintf(g_buf + n, "\r\n");
+    return n;
+}
+
+static int
+end_resp(unsigned int seq, int n)
+{
+    if(g_isbin)
+        term_put_bin_header(g_buf, g_bufsize, seq, g_req.status,
+            n - TERM_BIN_RESP_SIZE);
+    return n;
+}
 
 static void
 error_term()
 {
-    g_bytes_to_send = 
-        term_put_header(g_buf, g_bufsize, 0, g_req.status);
+    g_bytes_to_send = end_resp(0, begin_resp(0, 0));
 }
 
 static void
@@ -38,13 +65,12 @@ small_resp()
 {
     int respsize;
 
-    respsize = term_put_header(g_buf, g_bufsize, g_peer->p_seq,
-        g_req.status);
+    respsize = begin_resp(g_peer->p_seq, MSG_EMPTY != g_req.msg);
     if(MSG_EMPTY != g_req.msg)
     {
-        respsize += sprintf(g_buf + respsize, "\r\n%s", g_req.msg);
+        respsize += sprintf(g_buf + respsize, "%s", g_req.msg);
     }
-    g_bytes_to_send = respsize;
+    g_bytes_to_send = end_resp(g_peer->p_seq, respsize);
 }
 
 static int
@@ -176,8 +202,7 @@ do_ls()
     }
 
     g_req.status = OK;
-    n = term_put_header(g_buf, g_bufsize, g_peer->p_seq, g_req.status);
-    n += sprintf(g_buf + n, "\r\n");
+    n = begin_resp(g_peer->p_seq, 1);
     while(NULL != (entry = readdir(dir)))
     {
         if(entry->d_name[0] != '.')
@@ -195,7 +220,7 @@ do_ls()
         }
     }
     closedir(dir);
-    g_bytes_to_send = n;
+    g_bytes_to_send = end_resp(g_peer->p_seq, n);
 }
 
 static void
@@ -223,8 +248,9 @@ do_who()
     int n;
     int peers_cnt = 0;
 
-    n = term_put_header(g_buf, g_bufsize, g_peer->p_seq, g_req.status = OK);
-    n += sprintf(g_buf + n, "\r\nID\tUNAME\tMODE\tCWD\n");
+    g_req.status = OK;
+    n = begin_resp(g_peer->p_seq, 1);
+    n += sprintf(g_buf + n, "ID\tUNAME\tMODE\tCWD\n");
     handler_foreach(lambda(void, (struct peer* pp)
     {
         if(0 != pp->p_mode)
@@ -235,7 +261,7 @@ do_who()
         }
     }));
     n += sprintf(g_buf + n, "TOTAL: %d\n", peers_cnt);
-    g_bytes_to_send = n;
+    g_bytes_to_send = end_resp(g_peer->p_seq, n);
 }
 
 static int
@@ -358,7 +384,9 @@ service(struct peer* p)
     g_peer = p;
     g_req.msg = MSG_EMPTY;
 
-    int rv = term_parse_req(&g_req, g_buf);
+    g_isbin = term_is_bin(g_buf, g_buflen);
+    int rv = g_isbin ? term_parse_bin_req(&g_req, g_buf, g_buflen)
+        : term_parse_req(&g_req, g_buf);
 
     if(0 != g_req.seq) // successfully parsed seq number
     {